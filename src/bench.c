@@ -0,0 +1,213 @@
+
+#include "define.h"
+#include "codec.h"
+#include "pfs.h"
+#include "util_time.h"
+
+#define BENCH_BLOCK_BUF     (PFS_BLOCK_SIZE + 128)
+#define BENCH_SYNTH_SIZE    MEGABYTES(4)
+
+/* Compares the throughput and ratio of whichever codec backend this was built with, on the
+   entries of real archives and on some synthetic data. Build it once per backend:
+       
+       make bench codec=zlib
+       make bench codec=zlib-ng
+       make bench codec=libdeflate
+   
+   and run each binary on the same archives */
+   
+typedef struct BenchSet {
+    const char* name;
+    Array       data;
+} BenchSet;
+
+static uint32_t bench_rand(uint32_t* state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static int bench_synthetic(BenchSet* set, int kind)
+{
+    static const char* names[] = {"synthetic: random", "synthetic: names", "synthetic: frags"};
+    static const char* words[] = {"C03IKM", "_TRACK", "DEF", "BONE", "HUMHUM", "0x13", "ELF", "_DMSPRITEDEF", "SKELETON"};
+    uint32_t state = 0x9e3779b9;
+    uint32_t i;
+    byte* ptr;
+    int rc;
+    
+    /* Named first, so a set that can't be made can still be reported */
+    set->name = names[(kind < 2) ? kind : 2];
+    array_init(&set->data, byte);
+    
+    ptr = alloc_bytes(BENCH_SYNTH_SIZE);
+    
+    if (!ptr) return ERR_OutOfMemory;
+    
+    switch (kind)
+    {
+    case 0:
+        for (i = 0; i < BENCH_SYNTH_SIZE; i++)
+            ptr[i] = (byte)bench_rand(&state);
+        break;
+    
+    case 1:
+        for (i = 0; i < BENCH_SYNTH_SIZE;)
+        {
+            const char* w = words[bench_rand(&state) % (sizeof(words) / sizeof(words[0]))];
+            
+            while (*w && i < BENCH_SYNTH_SIZE)
+                ptr[i++] = (byte)*w++;
+            
+            if (i < BENCH_SYNTH_SIZE)
+                ptr[i++] = 0;
+        }
+        break;
+    
+    default:
+        /* Loosely like fragment data: small integers and slowly varying 16-bit values */
+        for (i = 0; i + 4 <= BENCH_SYNTH_SIZE; i += 4)
+        {
+            uint32_t v = (i & 64) ? (bench_rand(&state) & 0x3ff) : ((i / 4) & 0xff);
+            memcpy(ptr + i, &v, sizeof(v));
+        }
+        break;
+    }
+    
+    rc = array_append(&set->data, ptr, BENCH_SYNTH_SIZE);
+    free(ptr);
+    return rc;
+}
+
+static int bench_archive(BenchSet* set, const char* path)
+{
+    Pfs pfs;
+    Buffer* name;
+    uint32_t i = 0;
+    int rc = pfs_open(&pfs, path);
+    
+    array_init(&set->data, byte);
+    set->name = path;
+    
+    if (rc)
+    {
+        pfs_close(&pfs);
+        return rc;
+    }
+    
+    while ((name = pfs_get_name(&pfs, i++)))
+    {
+        Buffer* data = pfs_get(&pfs, buf_str(name), buf_length(name));
+        
+        if (!data)
+        {
+            rc = ERR_Compression;
+            break;
+        }
+        
+        rc = array_append(&set->data, buf_data(data), buf_length(data));
+        buf_destroy(data);
+        
+        if (rc) break;
+    }
+    
+    pfs_close(&pfs);
+    return rc;
+}
+
+static void bench_run(BenchSet* set, int level)
+{
+    const byte* src = array_raw(&set->data);
+    uint32_t len = array_count(&set->data);
+    uint32_t n = (len + PFS_BLOCK_SIZE - 1) / PFS_BLOCK_SIZE;
+    CodecCtx* codec = codec_ctx_create();
+    byte* packed = alloc_bytes((size_t)n * BENCH_BLOCK_BUF);
+    uint32_t* packedLen = alloc_array_type(n, uint32_t);
+    byte out[PFS_BLOCK_SIZE];
+    uint64_t total = 0;
+    double t0, t1, t2;
+    uint32_t i;
+    
+    if (!codec || !packed || !packedLen || n == 0)
+        goto done;
+    
+    t0 = time_now();
+    
+    for (i = 0; i < n; i++)
+    {
+        uint32_t r = (len - i * PFS_BLOCK_SIZE < PFS_BLOCK_SIZE) ? len - i * PFS_BLOCK_SIZE : PFS_BLOCK_SIZE;
+        
+        packedLen[i] = BENCH_BLOCK_BUF;
+        
+        if (codec_ctx_deflate(codec, packed + (size_t)i * BENCH_BLOCK_BUF, &packedLen[i], src + i * PFS_BLOCK_SIZE, r, level, CODEC_STRATEGY_Default))
+        {
+            printf("%-32s deflate failed at level %i\n", set->name, level);
+            goto done;
+        }
+        
+        total += packedLen[i];
+    }
+    
+    t1 = time_now();
+    
+    for (i = 0; i < n; i++)
+    {
+        uint32_t r = (len - i * PFS_BLOCK_SIZE < PFS_BLOCK_SIZE) ? len - i * PFS_BLOCK_SIZE : PFS_BLOCK_SIZE;
+        uint32_t olen = sizeof(out);
+        
+        if (codec_ctx_inflate(codec, out, &olen, packed + (size_t)i * BENCH_BLOCK_BUF, packedLen[i]) || olen != r ||
+            memcmp(out, src + i * PFS_BLOCK_SIZE, r) != 0)
+        {
+            printf("%-32s round trip failed at level %i\n", set->name, level);
+            goto done;
+        }
+    }
+    
+    t2 = time_now();
+    
+    printf("%-10s %-32s %5i %7.3f %10.1f %10.1f\n", codec_name(), set->name, level, (double)total / (double)len,
+        (double)len / MEGABYTES(1) / (t1 - t0), (double)len / MEGABYTES(1) / (t2 - t1));
+    
+done:
+    codec_ctx_destroy(codec);
+    if (packed) free(packed);
+    if (packedLen) free(packedLen);
+}
+
+int main(int argc, char** argv)
+{
+    static const int levels[] = {1, 6, 9};
+    int count = argc - 1 + 3;
+    int i, j;
+    
+    printf("%-10s %-32s %5s %7s %10s %10s\n", "backend", "data", "level", "ratio", "def MB/s", "inf MB/s");
+    
+    for (i = 0; i < count; i++)
+    {
+        BenchSet set;
+        int rc = (i < argc - 1) ? bench_archive(&set, argv[i + 1]) : bench_synthetic(&set, i - (argc - 1));
+        
+        if (rc)
+        {
+            printf("%-10s %-32s could not be loaded (error %i)\n", codec_name(), set.name, rc);
+            array_deinit(&set.data, NULL);
+            continue;
+        }
+        
+        for (j = 0; j < (int)(sizeof(levels) / sizeof(levels[0])); j++)
+        {
+            bench_run(&set, levels[j]);
+        }
+        
+        array_deinit(&set.data, NULL);
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+#undef BENCH_BLOCK_BUF
+#undef BENCH_SYNTH_SIZE
@@ -0,0 +1,247 @@
+
+#include "codec.h"
+#include "util_alloc.h"
+
+#if !defined(CODEC_LIBDEFLATE) && !defined(CODEC_ZLIB_NG) && !defined(CODEC_ZLIB)
+# define CODEC_ZLIB
+#endif
+
+#if defined(CODEC_LIBDEFLATE)
+
+#include <libdeflate.h>
+
+const char* codec_name(void)
+{
+    return "libdeflate";
+}
+
+#define CODEC_LIBDEFLATE_LEVELS 13
+
+struct CodecCtx {
+    struct libdeflate_compressor*   compressors[CODEC_LIBDEFLATE_LEVELS]; /* Created per level as they are needed */
+    struct libdeflate_decompressor* decompressor;
+};
+
+CodecCtx* codec_ctx_create(void)
+{
+    CodecCtx* ctx = alloc_type(CodecCtx);
+    
+    if (ctx)
+        memset(ctx, 0, sizeof(CodecCtx));
+    
+    return ctx;
+}
+
+void codec_ctx_destroy(CodecCtx* ctx)
+{
+    int i;
+    
+    if (!ctx) return;
+    
+    for (i = 0; i < CODEC_LIBDEFLATE_LEVELS; i++)
+    {
+        if (ctx->compressors[i])
+            libdeflate_free_compressor(ctx->compressors[i]);
+    }
+    
+    if (ctx->decompressor)
+        libdeflate_free_decompressor(ctx->decompressor);
+    
+    free(ctx);
+}
+
+int codec_ctx_deflate(CodecCtx* ctx, byte* dst, uint32_t* dstlen, const byte* src, uint32_t srclen, int level, int strategy)
+{
+    size_t len;
+    
+    (void)strategy;
+    
+    if (level < 0 || level >= CODEC_LIBDEFLATE_LEVELS)
+        return ERR_Invalid;
+    
+    if (!ctx->compressors[level])
+    {
+        ctx->compressors[level] = libdeflate_alloc_compressor(level);
+        if (!ctx->compressors[level]) return ERR_OutOfMemory;
+    }
+    
+    len = libdeflate_zlib_compress(ctx->compressors[level], src, srclen, dst, *dstlen);
+    
+    if (len == 0) return ERR_OutOfSpace;
+    
+    *dstlen = (uint32_t)len;
+    return ERR_None;
+}
+
+int codec_ctx_inflate(CodecCtx* ctx, byte* dst, uint32_t* dstlen, const byte* src, uint32_t srclen)
+{
+    enum libdeflate_result rc;
+    size_t len = 0;
+    
+    if (!ctx->decompressor)
+    {
+        ctx->decompressor = libdeflate_alloc_decompressor();
+        if (!ctx->decompressor) return ERR_OutOfMemory;
+    }
+    
+    rc = libdeflate_zlib_decompress(ctx->decompressor, src, srclen, dst, *dstlen, &len);
+    
+    if (rc != LIBDEFLATE_SUCCESS)
+        return (rc == LIBDEFLATE_INSUFFICIENT_SPACE) ? ERR_OutOfSpace : ERR_Compression;
+    
+    *dstlen = (uint32_t)len;
+    return ERR_None;
+}
+
+#undef CODEC_LIBDEFLATE_LEVELS
+
+#else /* zlib and zlib-ng share an API, give or take a prefix */
+
+#if defined(CODEC_ZLIB_NG)
+# include <zlib-ng.h>
+# define CODEC_BACKEND_NAME "zlib-ng"
+typedef zng_stream codec_stream;
+# define codec_deflate_init2 zng_deflateInit2
+# define codec_deflate_call zng_deflate
+# define codec_deflate_end zng_deflateEnd
+# define codec_deflate_reset zng_deflateReset
+# define codec_inflate_init zng_inflateInit
+# define codec_inflate_call zng_inflate
+# define codec_inflate_end zng_inflateEnd
+# define codec_inflate_reset zng_inflateReset
+#else
+# include <zlib.h>
+# define CODEC_BACKEND_NAME "zlib"
+typedef z_stream codec_stream;
+# define codec_deflate_init2 deflateInit2
+# define codec_deflate_call deflate
+# define codec_deflate_end deflateEnd
+# define codec_deflate_reset deflateReset
+# define codec_inflate_init inflateInit
+# define codec_inflate_call inflate
+# define codec_inflate_end inflateEnd
+# define codec_inflate_reset inflateReset
+#endif
+
+const char* codec_name(void)
+{
+    return CODEC_BACKEND_NAME;
+}
+
+struct CodecCtx {
+    codec_stream    def;
+    codec_stream    inf;
+    int             level;      /* What def was set up with; changing either means starting it over */
+    int             strategy;
+    bool            defReady;
+    bool            infReady;
+};
+
+CodecCtx* codec_ctx_create(void)
+{
+    CodecCtx* ctx = alloc_type(CodecCtx);
+    
+    if (ctx)
+        memset(ctx, 0, sizeof(CodecCtx));
+    
+    return ctx;
+}
+
+void codec_ctx_destroy(CodecCtx* ctx)
+{
+    if (!ctx) return;
+    
+    if (ctx->defReady)
+        codec_deflate_end(&ctx->def);
+    
+    if (ctx->infReady)
+        codec_inflate_end(&ctx->inf);
+    
+    free(ctx);
+}
+
+/* A reset stream produces exactly the same output as a freshly initialized one */
+int codec_ctx_deflate(CodecCtx* ctx, byte* dst, uint32_t* dstlen, const byte* src, uint32_t srclen, int level, int strategy)
+{
+    codec_stream* zs = &ctx->def;
+    int rc;
+    
+    if (ctx->defReady && (ctx->level != level || ctx->strategy != strategy))
+    {
+        codec_deflate_end(zs);
+        ctx->defReady = false;
+    }
+    
+    if (ctx->defReady)
+    {
+        rc = codec_deflate_reset(zs);
+    }
+    else
+    {
+        memset(zs, 0, sizeof(codec_stream));
+        rc = codec_deflate_init2(zs, level, Z_DEFLATED, MAX_WBITS, 8, strategy);
+        
+        if (rc == Z_OK)
+        {
+            ctx->defReady = true;
+            ctx->level = level;
+            ctx->strategy = strategy;
+        }
+    }
+    
+    if (rc != Z_OK) return (rc == Z_MEM_ERROR) ? ERR_OutOfMemory : ERR_Invalid;
+    
+    zs->next_in = (byte*)src;
+    zs->avail_in = srclen;
+    zs->next_out = dst;
+    zs->avail_out = *dstlen;
+    
+    rc = codec_deflate_call(zs, Z_FINISH);
+    *dstlen = (uint32_t)zs->total_out;
+    
+    if (rc == Z_STREAM_END) return ERR_None;
+    
+    return (rc == Z_OK || rc == Z_BUF_ERROR) ? ERR_OutOfSpace : ERR_Compression;
+}
+
+int codec_ctx_inflate(CodecCtx* ctx, byte* dst, uint32_t* dstlen, const byte* src, uint32_t srclen)
+{
+    codec_stream* zs = &ctx->inf;
+    int rc;
+    
+    if (ctx->infReady)
+    {
+        rc = codec_inflate_reset(zs);
+    }
+    else
+    {
+        memset(zs, 0, sizeof(codec_stream));
+        rc = codec_inflate_init(zs);
+        
+        if (rc == Z_OK)
+            ctx->infReady = true;
+    }
+    
+    if (rc != Z_OK) return (rc == Z_MEM_ERROR) ? ERR_OutOfMemory : ERR_Compression;
+    
+    zs->next_in = (byte*)src;
+    zs->avail_in = srclen;
+    zs->next_out = dst;
+    zs->avail_out = *dstlen;
+    
+    rc = codec_inflate_call(zs, Z_FINISH);
+    
+    if (rc == Z_STREAM_END)
+    {
+        *dstlen = (uint32_t)zs->total_out;
+        return ERR_None;
+    }
+    
+    /* Like uncompress(): running out of input is a broken stream, running out of output isn't */
+    if (rc == Z_BUF_ERROR && zs->avail_out == 0)
+        return ERR_OutOfSpace;
+    
+    return (rc == Z_MEM_ERROR) ? ERR_OutOfMemory : ERR_Compression;
+}
+
+#endif
@@ -0,0 +1,38 @@
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include "define.h"
+
+/* Whole-buffer deflate/inflate of zlib-wrapped streams, which is what every PFS block is.
+   The backend is picked at build time; see the codec variable in the Makefile */
+   
+enum CodecStrategy {
+    CODEC_STRATEGY_Default,     /* These match zlib's Z_*_STRATEGY values */
+    CODEC_STRATEGY_Filtered,
+    CODEC_STRATEGY_HuffmanOnly,
+    CODEC_STRATEGY_Rle,
+    CODEC_STRATEGY_Fixed,
+    CODEC_STRATEGY_COUNT
+};
+
+#define CODEC_LEVEL_Store   0
+#define CODEC_LEVEL_Fastest 1
+#define CODEC_LEVEL_Best    9
+
+const char* codec_name(void);
+
+/* The (de)compression state is kept in a context between calls and only reset for each block, rather
+   than being set up and torn down every time. A context is cheap until it is first used, and must only
+   be used by one thread at a time. dstlen is the space available at dst on input, and the number of
+   bytes written on output */
+typedef struct CodecCtx CodecCtx;
+
+CodecCtx* codec_ctx_create(void);
+void codec_ctx_destroy(CodecCtx* ctx);
+/* libdeflate has no strategies, so with that backend strategy is ignored; PfsSaveStats still reports
+   whatever strategy was asked for */
+int codec_ctx_deflate(CodecCtx* ctx, byte* dst, uint32_t* dstlen, const byte* src, uint32_t srclen, int level, int strategy);
+int codec_ctx_inflate(CodecCtx* ctx, byte* dst, uint32_t* dstlen, const byte* src, uint32_t srclen);
+
+#endif/*CODEC_H*/
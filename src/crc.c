@@ -37,9 +37,13 @@ static uint32_t crc_table[] = {
 };
 
 uint32_t crc_calc(const void* data, uint32_t len)
+{
+    return crc_update(0, data, len);
+}
+
+uint32_t crc_update(uint32_t val, const void* data, uint32_t len)
 {
     const byte* ptr = (const byte*)data;
-    uint32_t val    = 0;
     uint32_t idx;
     uint32_t i;
     
@@ -5,5 +5,6 @@
 #include "define.h"
 
 uint32_t crc_calc(const void* data, uint32_t len);
+uint32_t crc_update(uint32_t crc, const void* data, uint32_t len); /* Continues a crc_calc() over more data */
 
 #endif/*CRC_H*/
@@ -31,3 +31,50 @@ uint32_t hash_cstr(const char* key, uint32_t len)
     
     return h;
 }
+
+#define HASH_PRIME64_1 0x9e3779b185ebca87ULL
+#define HASH_PRIME64_2 0xc2b2ae3d27d4eb4fULL
+#define HASH_PRIME64_3 0x165667b19e3779f9ULL
+
+/* Not cryptographic; meant for telling apart large blobs of file data quickly */
+uint64_t hash_data64(const void* data, uint32_t len)
+{
+    const byte* ptr = (const byte*)data;
+    uint64_t h      = HASH_PRIME64_3 + (uint64_t)len * HASH_PRIME64_1;
+    uint64_t k;
+    
+    while (len >= sizeof(uint64_t))
+    {
+        memcpy(&k, ptr, sizeof(uint64_t));
+        
+        k *= HASH_PRIME64_2;
+        k = bit_rotate(k, 31);
+        k *= HASH_PRIME64_1;
+        h ^= k;
+        h = bit_rotate(h, 27) * HASH_PRIME64_1 + HASH_PRIME64_3;
+        
+        ptr += sizeof(uint64_t);
+        len -= sizeof(uint64_t);
+    }
+    
+    while (len > 0)
+    {
+        h ^= (*ptr) * HASH_PRIME64_3;
+        h = bit_rotate(h, 11) * HASH_PRIME64_1;
+        
+        ptr++;
+        len--;
+    }
+    
+    h ^= h >> 33;
+    h *= HASH_PRIME64_2;
+    h ^= h >> 29;
+    h *= HASH_PRIME64_3;
+    h ^= h >> 32;
+    
+    return h;
+}
+
+#undef HASH_PRIME64_1
+#undef HASH_PRIME64_2
+#undef HASH_PRIME64_3
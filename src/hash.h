@@ -7,5 +7,6 @@
 
 uint32_t hash_int64(int64_t val);
 uint32_t hash_cstr(const char* str, uint32_t len);
+uint64_t hash_data64(const void* data, uint32_t len);
 
 #endif/*HASH_H*/
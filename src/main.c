@@ -3,10 +3,75 @@
 #include "pfs.h"
 #include "wld.h"
 #include "virtual_wld.h"
+#include "wld_rules.h"
+#include "util_time.h"
 
 #define TARGET_PFS "global4_chr.s3d"
-#define BACKUP_PFS "global4_chr.zae"
-#define TARGET_WLD "global4_chr.wld"
+#define PFS_EXT ".s3d"
+#define BACKUP_EXT ".zae"
+#define MANIFEST_EXT ".manifest"
+#define MANIFEST_VERSION 1
+#define WLD_EXT ".wld"
+#define PATCH_PATH_MAX 512
+
+#ifdef PLATFORM_WINDOWS
+# define PFS_DIR_PATTERN "/*" PFS_EXT
+#else
+# define PFS_DIR_PATTERN "/*.[sS]3[dD]" /* glob() is case sensitive, unlike the client */
+#endif
+
+#ifdef PLATFORM_WINDOWS
+# define vsnprintf _vsnprintf
+#endif
+
+typedef struct Patch {
+    char        target[PATCH_PATH_MAX]; /* X.s3d */
+    char        backup[PATCH_PATH_MAX]; /* X.zae, the untouched original */
+    char        wld[PATCH_PATH_MAX];    /* X.wld, inside the archive */
+    char        manifest[PATCH_PATH_MAX]; /* X.manifest, describing the last successful patch */
+    bool        batch;      /* Quiet, single-threaded, and reported on once everything is done */
+    bool        skipped;
+    bool        upToDate;   /* The manifest showed there was nothing to do */
+    bool        unchanged;  /* Nothing in the datafile matched the rules, so nothing was written */
+    int         rc;
+    char        error[256]; /* The first error, in batch mode */
+    double      seconds;
+    const WldRuleSet*   rules;  /* Shared by every Patch in a batch; only read */
+    WldRuleStats        ruleStats;
+    PfsFingerprint  base;   /* The datafile as it was before this patch */
+    Thread      backupThread; /* Copying the target to the backup while the datafile is worked on */
+    FileMap*    backupSrc;
+    bool        backupNeeded; /* The target is the base, rather than an existing backup */
+    bool        backupPending;
+    int         backupRc;
+    PfsSaveStats    stats;
+} Patch;
+
+/* An archive a batch was asked to patch, and the file it really is */
+typedef struct BatchPath {
+    Buffer*     path;
+    FileId      id;
+    bool        known;  /* The id could be read; if not, the path is kept and fails when it's opened */
+} BatchPath;
+
+/* What was patched, and into what, last time. If the rules, the base datafile and the patched archive
+   all still match, running again would only write out the same archive */
+typedef struct PatchManifest {
+    uint64_t        rules;
+    PfsFingerprint  base;
+    uint32_t        targetSize;
+    PfsFingerprint  target;
+} PatchManifest;
+
+/* Every change the patch makes to a datafile, all applied in one pass: the Iksar models' (C03IKM
+   and C09IKM) animations are moved to the end, each 0x13 taking a new copy of its 0x12 track along
+   with it, and the original tracks are dropped */
+static const WldRule patchRules[] = {
+    { "C03IKM", 0x12, WLD_RULE_Drop },
+    { "C03IKM", 0x13, WLD_RULE_MoveToEnd },
+    { "C09IKM", 0x12, WLD_RULE_Drop },
+    { "C09IKM", 0x13, WLD_RULE_MoveToEnd }
+};
 
 static void output(FILE* fp, const char* fmt, ...)
 {
@@ -17,6 +82,37 @@ static void output(FILE* fp, const char* fmt, ...)
     fflush(fp);
 }
 
+static void patch_info(Patch* p, const char* fmt, ...)
+{
+    va_list args;
+    
+    if (p->batch) return;
+    
+    va_start(args, fmt);
+    vfprintf(stdout, fmt, args);
+    va_end(args);
+    fflush(stdout);
+}
+
+static void patch_error(Patch* p, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    
+    if (!p->batch)
+    {
+        vfprintf(stderr, fmt, args);
+        fflush(stderr);
+    }
+    else if (p->error[0] == 0)
+    {
+        vsnprintf(p->error, sizeof(p->error), fmt, args);
+        p->error[sizeof(p->error) - 1] = 0;
+    }
+    
+    va_end(args);
+}
+
 static const char* errmsg(int rc)
 {
     switch (rc)
@@ -28,125 +124,294 @@ static const char* errmsg(int rc)
         return "Could not open file";
     case ERR_OutOfMemory:
         return "Out of memory";
+    case ERR_OutOfSpace:
+        return "Data did not fit where it was being written";
+    case ERR_FileOperation:
+        return "Could not read or write file";
+    case ERR_Compression:
+        return "Compressed data was corrupt or could not be compressed";
+    case ERR_CouldNotCreate:
+        return "Could not start a thread";
     default:
         return "Unknown error";
     }
 }
 
-static int save_raw(Pfs* pfs, const char* path)
+static const char* strategy_name(int strategy)
 {
-    Buffer* raw = pfs->raw;
-    FILE* fp = fopen(path, "wb+");
-    int rc = ERR_None;
+    switch (strategy)
+    {
+    case CODEC_STRATEGY_Filtered:
+        return "filtered";
+    case CODEC_STRATEGY_HuffmanOnly:
+        return "huffman only";
+    case CODEC_STRATEGY_Rle:
+        return "rle";
+    case CODEC_STRATEGY_Fixed:
+        return "fixed";
+    default:
+        return "default";
+    }
+}
+
+/* X.s3d is patched in place, with X.zae as the backup, X.manifest as the record of the last patch,
+   and X.wld as the datafile inside it */
+static int patch_init(Patch* p, const char* path, const WldRuleSet* rules, bool batch)
+{
+    uint32_t len = strlen(path);
+    const char* name = path;
+    const char* ptr;
+    uint32_t i;
     
-    if (!fp) return ERR_CouldNotOpen;
+    memset(p, 0, sizeof(Patch));
+    p->rules = rules;
+    p->batch = batch;
     
-    if (fwrite(buf_data(raw), sizeof(byte), buf_length(raw), fp) != buf_length(raw))
-        rc = ERR_FileOperation;
+    for (ptr = path; *ptr; ptr++)
+    {
+        if (*ptr == '/' || *ptr == '\\')
+            name = ptr + 1;
+    }
     
-    fclose(fp);
-    return rc;
+    if (len < sizeof(PFS_EXT) || len + sizeof(MANIFEST_EXT) - sizeof(PFS_EXT) >= PATCH_PATH_MAX)
+        goto invalid;
+    
+    for (i = 0; i < sizeof(PFS_EXT) - 1; i++)
+    {
+        if (tolower((unsigned char)path[len - sizeof(PFS_EXT) + 1 + i]) != PFS_EXT[i])
+            goto invalid;
+    }
+    
+    len -= sizeof(PFS_EXT) - 1;
+    
+    memcpy(p->target, path, len + sizeof(PFS_EXT));
+    memcpy(p->backup, path, len);
+    memcpy(p->backup + len, BACKUP_EXT, sizeof(BACKUP_EXT));
+    memcpy(p->manifest, path, len);
+    memcpy(p->manifest + len, MANIFEST_EXT, sizeof(MANIFEST_EXT));
+    
+    /* Names inside the client's archives are always lower case, whatever the archive itself is called */
+    len -= (uint32_t)(name - path);
+    
+    for (i = 0; i < len; i++)
+    {
+        p->wld[i] = (char)tolower((unsigned char)name[i]);
+    }
+    
+    memcpy(p->wld + len, WLD_EXT, sizeof(WLD_EXT));
+    return ERR_None;
+    
+invalid:
+    strncpy(p->target, path, sizeof(p->target) - 1);
+    patch_error(p, "'%s' is not a " PFS_EXT " archive\n", path);
+    return (p->rc = ERR_Invalid);
+}
+
+static void patch_configure(Patch* p, Pfs* pfs)
+{
+#ifdef DEBUG
+    /* Debug builds are for testing changes to the transform, not for shipping */
+    pfs_set_compression_preset(pfs, PFS_COMPRESS_Fast);
+#else
+    pfs_set_compression_preset(pfs, PFS_COMPRESS_Max);
+#endif
+    
+    /* Batches already keep every core busy with one archive each */
+    if (p->batch)
+        pfs_set_threads(pfs, 1);
 }
 
-static int main_open(Pfs* pfs)
+static void patch_backup_proc(void* ud)
 {
-    int rc = pfs_open(pfs, BACKUP_PFS);
+    Patch* p = (Patch*)ud;
+    p->backupRc = file_copy(p->backup, p->backupSrc);
+}
+
+/* The backup is only I/O and writing out the datafile is only CPU, so they overlap. The copy reads
+   the archive's mapping, which nothing changes until pfs_save_as, and that waits for it */
+static void patch_backup_start(Patch* p, Pfs* pfs)
+{
+    patch_info(p, "Creating backup file '%s'...\n", p->backup);
+    p->backupSrc = pfs_raw_file(pfs);
+    p->backupRc = ERR_None;
+    
+    if (thread_start(&p->backupThread, patch_backup_proc, p) == ERR_None)
+        p->backupPending = true;
+    else
+        patch_backup_proc(p);
+}
+
+static int patch_backup_finish(Patch* p)
+{
+    if (p->backupPending)
+    {
+        thread_join(&p->backupThread);
+        p->backupPending = false;
+    }
+    
+    if (p->backupRc)
+        patch_error(p, "Error creating backup: %s\n", errmsg(p->backupRc));
+    
+    return p->backupRc;
+}
+
+static int patch_open(Patch* p, Pfs* pfs)
+{
+    int rc = pfs_open(pfs, p->backup);
     
     if (rc == ERR_None)
     {
-        output(stdout, "Backup file '" BACKUP_PFS "' already exists; using it as a base\n");
+        patch_info(p, "Backup file '%s' already exists; using it as a base\n", p->backup);
+        patch_configure(p, pfs);
         return ERR_None;
     }
     
     pfs_close(pfs); /* Just in case the backup file was partially opened somehow */
-    rc = pfs_open(pfs, TARGET_PFS);
+    rc = pfs_open(pfs, p->target);
     
     if (rc)
     {
-        if (rc == ERR_CouldNotOpen)
-            output(stderr, "Could not open '" TARGET_PFS "': make sure you're running this from your EQ folder!\n");
+        if (rc == ERR_CouldNotOpen && !p->batch)
+            patch_error(p, "Could not open '%s': make sure you're running this from your EQ folder!\n", p->target);
         else
-            output(stderr, "Could not open '" TARGET_PFS "': %s\n", errmsg(rc));
+            patch_error(p, "Could not open '%s': %s\n", p->target, errmsg(rc));
         
         return rc;
     }
     
-    output(stdout, "Found '" TARGET_PFS "'\nCreating backup file '" BACKUP_PFS "'...\n");
-    rc = save_raw(pfs, BACKUP_PFS);
+    patch_configure(p, pfs);
+    patch_info(p, "Found '%s'\n", p->target);
+    p->backupNeeded = true;
+    return ERR_None;
+}
+
+static void output_save_stats(Patch* p, Pfs* pfs)
+{
+    const PfsSaveStats* stats = pfs_save_stats(pfs);
     
-    if (rc)
-        output(stderr, "Error creating backup: %s\n", errmsg(rc));
+    patch_info(p, "Compression level %i, %s strategy: %u of %u entries replaced, %u blocks compressed, %u reused, %u bytes written\n",
+        stats->compression.level, strategy_name(stats->compression.strategy), stats->entriesReplaced, stats->entriesWritten,
+        stats->blocksCompressed, stats->blocksReused, stats->bytesWritten);
+}
+
+static bool fingerprint_equal(const PfsFingerprint* a, const PfsFingerprint* b)
+{
+    return (a->hash == b->hash && a->crc == b->crc && a->inflatedLen == b->inflatedLen && a->deflatedLen == b->deflatedLen);
+}
+
+/* Only reads the archive's directory and the datafile's compressed bytes */
+static int archive_fingerprint(const char* path, const char* wld, uint32_t* size, PfsFingerprint* out)
+{
+    Pfs pfs;
+    int rc = pfs_open_flags(&pfs, path, PFS_OPEN_Fast);
+    
+    if (!rc)
+        rc = pfs_fingerprint(&pfs, wld, 0, out);
     
+    if (!rc && size)
+        *size = pfs_raw_length(&pfs);
+    
+    pfs_close(&pfs);
     return rc;
 }
 
-static int modify_wld(VirtualWld* vwld, Wld* wld)
+static int manifest_read(const char* path, PatchManifest* m)
 {
-    Array* frags = &wld->fragsByIndex;
-    Array delayed;
-    uint32_t i = 0;
-    Frag** ptr;
+    FILE* fp = fopen(path, "r");
+    uint32_t version, rulesHi, rulesLo, baseHi, baseLo, targetHi, targetLo;
+    int n;
+    
+    if (!fp) return ERR_CouldNotOpen;
+    
+    n = fscanf(fp, " version %u rules %8x%8x base %x %u %u %8x%8x target %u %x %u %u %8x%8x", &version, &rulesHi, &rulesLo,
+        &m->base.crc, &m->base.inflatedLen, &m->base.deflatedLen, &baseHi, &baseLo,
+        &m->targetSize, &m->target.crc, &m->target.inflatedLen, &m->target.deflatedLen, &targetHi, &targetLo);
+    
+    fclose(fp);
+    
+    if (n != 14 || version != MANIFEST_VERSION)
+        return ERR_Invalid;
+    
+    m->rules        = ((uint64_t)rulesHi << 32) | rulesLo;
+    m->base.hash    = ((uint64_t)baseHi << 32) | baseLo;
+    m->target.hash  = ((uint64_t)targetHi << 32) | targetLo;
+    return ERR_None;
+}
+
+static int manifest_write(const char* path, const PatchManifest* m)
+{
+    FILE* fp = fopen(path, "w");
+    int rc = ERR_None;
+    
+    if (!fp) return ERR_CouldNotOpen;
+    
+    fprintf(fp, "version %u\nrules %08x%08x\n", MANIFEST_VERSION, (uint32_t)(m->rules >> 32), (uint32_t)m->rules);
+    fprintf(fp, "base %08x %u %u %08x%08x\n", m->base.crc, m->base.inflatedLen, m->base.deflatedLen,
+        (uint32_t)(m->base.hash >> 32), (uint32_t)m->base.hash);
+    fprintf(fp, "target %u %08x %u %u %08x%08x\n", m->targetSize, m->target.crc, m->target.inflatedLen, m->target.deflatedLen,
+        (uint32_t)(m->target.hash >> 32), (uint32_t)m->target.hash);
+    
+    if (ferror(fp))
+        rc = ERR_FileOperation;
+    
+    if (fclose(fp) && !rc)
+        rc = ERR_FileOperation;
+    
+    return rc;
+}
+
+/* True if the last successful patch was made with the same rules, from the same backup, and the
+   archive it wrote hasn't changed since */
+static bool patch_up_to_date(Patch* p)
+{
+    PatchManifest m;
+    PfsFingerprint fp;
+    uint32_t size;
+    
+    if (manifest_read(p->manifest, &m) || m.rules != ruleset_fingerprint(p->rules))
+        return false;
+    
+    if (archive_fingerprint(p->backup, p->wld, NULL, &fp) || !fingerprint_equal(&fp, &m.base))
+        return false;
+    
+    if (archive_fingerprint(p->target, p->wld, &size, &fp) || size != m.targetSize || !fingerprint_equal(&fp, &m.target))
+        return false;
+    
+    return true;
+}
+
+static void patch_write_manifest(Patch* p)
+{
+    PatchManifest m;
     int rc;
     
-    array_init(&delayed, Frag*);
+    m.rules = ruleset_fingerprint(p->rules);
+    m.base  = p->base;
     
-    while ( (ptr = array_get(frags, ++i, Frag*)) )
-    {
-        Frag* frag = *ptr;
-        const char* name = wld_frag_name(wld, frag);
-        uint32_t len = 0;
-        
-        if (name)
-        {
-            len = strlen(name);
-            
-            if (len >= 6 && (frag->type == 0x13 || frag->type == 0x12))
-            {
-                if (name[0] == 'C' && name[1] == '0' && (name[2] == '3' || name[2] == '9') && name[3] == 'I' && name[4] == 'K' && name[5] == 'M')
-                {
-                    if (frag->type == 0x13)
-                    {
-                        if (!array_push_back(&delayed, (void*)&frag))
-                        {
-                            rc = ERR_OutOfMemory;
-                            goto abort;
-                        }
-                    }
-                    
-                    continue;
-                }
-            }
-        }
-        
-        rc = vwld_add_old_frag(vwld, i, frag, name, len);
-        if (rc) goto abort;
-    }
+    rc = archive_fingerprint(p->target, p->wld, &m.targetSize, &m.target);
+    
+    if (!rc)
+        rc = manifest_write(p->manifest, &m);
     
-    i = 0;
-    while ( (ptr = array_get(&delayed, i++, Frag*)) )
+    /* Not worth failing over; the next run just won't know it can skip the work */
+    if (rc)
     {
-        Frag13* f13 = (Frag13*)*ptr;
-        Frag12* f12 = (Frag12*)wld_frag_by_ref(wld, f13->ref);
-        const char* name = wld_frag_name(wld, &f12->frag);
-        
-        rc = vwld_add_new_frag(vwld, f12, name);
-        if (rc) goto abort;
-        
-        f13->ref = vwld_last_added_ref(vwld);
-        rc = vwld_add_new_frag(vwld, f13, wld_frag_name(wld, &f13->frag));
-        if (rc) goto abort;
+        patch_info(p, "Could not write '%s': %s\n", p->manifest, errmsg(rc));
+        remove(p->manifest);
     }
+}
+
+static int modify_wld(Patch* p, VirtualWld* vwld, Wld* wld)
+{
+    int rc = ruleset_apply(p->rules, vwld, wld, &p->ruleStats);
     
-    array_deinit(&delayed, NULL);
-    return ERR_None;
+    if (rc)
+        patch_error(p, "Error while modifying '%s': %s\n", p->wld, errmsg(rc));
     
-abort:
-    array_deinit(&delayed, NULL);
-    output(stderr, "Error while modifying '" TARGET_WLD "': %s\n", errmsg(rc));
     return rc;
 }
 
-static int process_wld(Pfs* pfs, Buffer* data)
+static int process_wld(Patch* p, Pfs* pfs, Buffer* data)
 {
     Wld wld;
     VirtualWld vwld;
@@ -155,52 +420,70 @@ static int process_wld(Pfs* pfs, Buffer* data)
     
     if (rc)
     {
-        output(stderr, "Error loading internal datafile '" TARGET_WLD "': %s\n", errmsg(rc));
+        patch_error(p, "Error loading internal datafile '%s': %s\n", p->wld, errmsg(rc));
         wld_close(&wld);
         return rc;
     }
     
-    output(stdout, "Opened internal datafile '" TARGET_WLD "'\n");
+    patch_info(p, "Opened internal datafile '%s'\n", p->wld);
     
     rc = vwld_init(&vwld, &wld);
     
     if (rc)
     {
-        output(stderr, "Preparations to modify '" TARGET_WLD "' failed: %s\n", errmsg(rc));
+        patch_error(p, "Preparations to modify '%s' failed: %s\n", p->wld, errmsg(rc));
         goto abort;
     }
     
-    rc = modify_wld(&vwld, &wld);
+    rc = modify_wld(p, &vwld, &wld);
     if (rc) goto abort;
     
+    /* Writing the archive back out would only recompress the same datafile */
+    if (p->ruleStats.moved == 0 && p->ruleStats.dropped == 0 && p->ruleStats.duplicated == 0)
+    {
+        patch_info(p, "Nothing in '%s' matched the rules; leaving '%s' as it is\n", p->wld, p->target);
+        p->unchanged = true;
+        goto abort;
+    }
+    
+    if (p->backupNeeded)
+        patch_backup_start(p, pfs);
+    
     saved = vwld_save(&vwld);
     
     if (!saved)
     {
-        output(stderr, "Could not write modified '" TARGET_WLD "': Out of memory\n");
+        patch_error(p, "Could not write modified '%s': Out of memory\n", p->wld);
         rc = ERR_OutOfMemory;
         goto abort;
     }
     
-    rc = pfs_put(pfs, TARGET_WLD, sizeof(TARGET_WLD) - 1, buf_data(saved), buf_length(saved));
+    rc = pfs_put(pfs, p->wld, strlen(p->wld), buf_data(saved), buf_length(saved));
     
     if (rc)
     {
-        output(stderr, "Could not re-insert modified '" TARGET_WLD "': %s\n", errmsg(rc));
+        patch_error(p, "Could not re-insert modified '%s': %s\n", p->wld, errmsg(rc));
         goto no_insert;
     }
     
-    output(stdout, "Modified '" TARGET_WLD "' successfully\n");
+    patch_info(p, "Modified '%s' successfully\n", p->wld);
+    
+    /* Nothing may overwrite the target until its backup is safely written */
+    rc = patch_backup_finish(p);
+    if (rc) goto no_insert;
     
-    rc = pfs_save_as(pfs, TARGET_PFS);
+    rc = pfs_save_as(pfs, p->target);
     
     if (rc)
     {
-        output(stderr, "Error while saving changes to '" TARGET_PFS "': %s\n", errmsg(rc));
+        patch_error(p, "Error while saving changes to '%s': %s\n", p->target, errmsg(rc));
         goto no_insert;
     }
     
-    output(stdout, "Saved changes to '" TARGET_PFS "'\n");
+    patch_info(p, "Saved changes to '%s'\n", p->target);
+    output_save_stats(p, pfs);
+    p->stats = *pfs_save_stats(pfs);
+    patch_write_manifest(p);
     rc = ERR_None;
     
 no_insert:
@@ -211,7 +494,7 @@ abort:
     return rc;
 }
 
-static int main_process(Pfs* pfs)
+static int patch_process(Patch* p, Pfs* pfs)
 {
     uint32_t i = 0;
     
@@ -222,38 +505,394 @@ static int main_process(Pfs* pfs)
         
         if (!name) break;
         
-        if (strcmp(buf_str(name), TARGET_WLD) != 0)
+        if (strcmp(buf_str(name), p->wld) != 0)
             continue;
         
-        data = pfs_get(pfs, buf_str(name), buf_length(name));
+        if (pfs_fingerprint(pfs, buf_str(name), buf_length(name), &p->base) == ERR_None)
+            data = pfs_get(pfs, buf_str(name), buf_length(name));
+        else
+            data = NULL;
         
         if (!data)
         {
-            output(stderr, "Decompression of internal datafile '" TARGET_WLD "' failed\n");
+            patch_error(p, "Decompression of internal datafile '%s' failed\n", p->wld);
             return ERR_Invalid;
         }
         
-        return process_wld(pfs, data);
+        return process_wld(p, pfs, data);
     }
     
-    output(stderr, "Could not find internal datafile '" TARGET_WLD "'\n");
+    patch_error(p, "Could not find internal datafile '%s'\n", p->wld);
     return ERR_Invalid;
 }
 
-int main(void)
+static int patch_run(Patch* p)
 {
-    int rc;
+    double start = time_now();
     Pfs pfs;
     
-    rc = (main_open(&pfs) || main_process(&pfs));
+    if (patch_up_to_date(p))
+    {
+        patch_info(p, "'%s' is already patched; nothing to do (delete '%s' to patch it again anyway)\n", p->target, p->manifest);
+        p->upToDate = true;
+        p->seconds = time_now() - start;
+        return (p->rc = ERR_None);
+    }
+    
+    p->rc = patch_open(p, &pfs);
+    
+    if (!p->rc)
+        p->rc = patch_process(p, &pfs);
+    
+    /* Only still going if something failed before the save; the mapping it reads has to outlive it */
+    if (p->backupPending)
+        patch_backup_finish(p);
+    
+    pfs_close(&pfs);
+    p->seconds = time_now() - start;
+    return p->rc;
+}
+
+/* Cheap check that an archive is one the patch applies to: it has to hold a valid X.wld with some
+   name that a rule could match. This only reads the directory and the blocks holding the datafile's
+   header and string table. Anything this can't rule out is left to patch_run */
+static bool patch_sniff(Patch* p)
+{
+    WldHeader h;
+    PfsReader rd;
+    Pfs pfs;
+    char* strings = NULL;
+    uint32_t len, i;
+    bool match = false;
+    
+    if (pfs_open_flags(&pfs, p->target, PFS_OPEN_Fast) || pfs_read_range(&pfs, p->wld, 0, sizeof(h), &h) ||
+        wld_check_header(&h) || pfs_reader_open(&rd, &pfs, p->wld, 0))
+    {
+        p->skipped = true;
+        goto done;
+    }
+    
+    len = pfs_reader_length(&rd);
+    pfs_reader_close(&rd);
+    
+    if (h.stringsLength > len - sizeof(h))
+    {
+        p->skipped = true;
+        goto done;
+    }
+    
+    strings = alloc_array_type(h.stringsLength + 1, char);
+    
+    if (!strings)
+    {
+        match = true;
+        goto done;
+    }
+    
+    if (pfs_read_range(&pfs, p->wld, sizeof(h), h.stringsLength, strings))
+    {
+        p->skipped = true;
+        goto done;
+    }
+    
+    wld_process_string(strings, h.stringsLength);
+    strings[h.stringsLength] = 0;
+    
+    for (i = 0; i < h.stringsLength && !match; i += strlen(&strings[i]) + 1)
+    {
+        match = ruleset_may_match(p->rules, &strings[i]);
+    }
+    
+    p->unchanged = !match;
+    
+done:
+    if (strings) free(strings);
+    pfs_close(&pfs);
+    return match;
+}
+
+static void batch_worker(void* ud, uint32_t index, uint32_t worker)
+{
+    Patch* p = (Patch*)ud + index;
+    
+    (void)worker;
+    
+    if (p->rc) return;
+    
+    if (patch_sniff(p))
+        patch_run(p);
+}
+
+static void batch_report(Patch* patches, uint32_t count, uint32_t threads, double seconds)
+{
+    uint32_t patched = 0;
+    uint32_t current = 0;
+    uint32_t failed = 0;
+    uint32_t skipped = 0;
+    uint32_t i;
+    
+    output(stdout, "%-40s %-8s %8s  %s\n", "Archive", "Result", "Seconds", "Details");
+    
+    for (i = 0; i < count; i++)
+    {
+        Patch* p = &patches[i];
+        
+        if (p->skipped)
+        {
+            output(stdout, "%-40s %-8s %8s  no valid '%s' inside\n", p->target, "skipped", "", p->wld);
+            skipped++;
+        }
+        else if (p->unchanged)
+        {
+            output(stdout, "%-40s %-8s %8.2f  nothing in '%s' matched the rules\n", p->target, "skipped", p->seconds, p->wld);
+            skipped++;
+        }
+        else if (p->upToDate)
+        {
+            output(stdout, "%-40s %-8s %8.2f  already patched\n", p->target, "current", p->seconds);
+            current++;
+        }
+        else if (p->rc)
+        {
+            output(stdout, "%-40s %-8s %8.2f  %s", p->target, "failed", p->seconds, p->error[0] ? p->error : "\n");
+            failed++;
+        }
+        else
+        {
+            output(stdout, "%-40s %-8s %8.2f  %u fragments moved, %u dropped, %u duplicated, %u of %u entries replaced, %u bytes written\n", p->target, "patched",
+                p->seconds, p->ruleStats.moved, p->ruleStats.dropped, p->ruleStats.duplicated, p->stats.entriesReplaced, p->stats.entriesWritten, p->stats.bytesWritten);
+            patched++;
+        }
+    }
+    
+    output(stdout, "%u patched, %u already patched, %u failed, %u skipped in %.2f seconds on %u threads\n", patched, current, failed, skipped,
+        seconds, threads);
+}
+
+static int batch_path_less(const void* a, const void* b)
+{
+    Buffer* pa = *(Buffer**)a;
+    Buffer* pb = *(Buffer**)b;
+    
+#ifdef PLATFORM_WINDOWS
+    return _stricmp(buf_str(pa), buf_str(pb)) < 0;
+#else
+    return strcmp(buf_str(pa), buf_str(pb)) < 0;
+#endif
+}
+
+static int batch_id_less(const void* a, const void* b)
+{
+    BatchPath* pa = (BatchPath*)a;
+    BatchPath* pb = (BatchPath*)b;
+    
+    if (pa->known != pb->known)
+        return pa->known < pb->known;
+    
+    if (pa->id.volume != pb->id.volume)
+        return pa->id.volume < pb->id.volume;
+    
+    if (pa->id.index != pb->id.index)
+        return pa->id.index < pb->id.index;
+    
+    return batch_path_less(&pa->path, &pb->path);
+}
+
+/* Overlapping arguments can list the same archive more than once, and two workers must never patch
+   the same file. Paths are compared by the file they name, since "dir" and "./dir" spell the same
+   archive differently; of each set of repeats, the first path in sorted order is the one kept */
+static int batch_unique_paths(Array* paths)
+{
+    Array ids;
+    BatchPath entry;
+    BatchPath* bp;
+    Buffer** path;
+    uint32_t count = array_count(paths);
+    uint32_t kept = 0;
+    uint32_t i;
+    int rc;
+    
+    if (count < 2)
+        return ERR_None;
+    
+    array_init(&ids, BatchPath);
+    
+    rc = array_reserve(&ids, count + 1); /* One over for array_sort's scratch element */
+    if (rc) goto abort;
+    
+    path = array_data(paths, Buffer*);
+    
+    for (i = 0; i < count; i++)
+    {
+        entry.path  = path[i];
+        entry.known = (file_id(buf_str(path[i]), &entry.id) == ERR_None);
+        array_push_back(&ids, &entry);
+    }
+    
+    rc = array_sort(&ids, batch_id_less);
+    if (rc) goto abort;
+    
+    bp = array_data(&ids, BatchPath);
+    
+    for (i = 0; i < count; i++)
+    {
+        if (kept > 0 && bp[i].known && bp[kept - 1].known && file_id_equal(&bp[i].id, &bp[kept - 1].id))
+        {
+            buf_destroy(bp[i].path);
+            continue;
+        }
+        
+        bp[kept] = bp[i];
+        path[kept++] = bp[i].path;
+    }
+    
+    array_clear_index_and_above(paths, kept);
+    
+    /* Back into the order they're reported in */
+    rc = array_sort(paths, batch_path_less);
+    
+abort:
+    array_deinit(&ids, NULL);
+    return rc;
+}
+
+/* Each argument is a directory, whose *.s3d archives are all considered, or a wildcard pattern */
+static int batch_run(int argc, char** argv, const WldRuleSet* rules)
+{
+    Array paths;
+    Patch* patches = NULL;
+    uint32_t threads = thread_cpu_count();
+    uint32_t failed = 0;
+    uint32_t count, i;
+    double start;
+    int rc = ERR_None;
+    int a;
+    
+    array_init(&paths, Buffer*);
+    
+    for (a = 1; a < argc && !rc; a++)
+    {
+        char pattern[PATCH_PATH_MAX];
+        uint32_t len = strlen(argv[a]);
+        
+        if (file_is_dir(argv[a]))
+        {
+            if (len + sizeof(PFS_DIR_PATTERN) > sizeof(pattern))
+            {
+                rc = ERR_Invalid;
+                break;
+            }
+            
+            /* So that "dir" and "dir/" list their archives the same way */
+            while (len > 1 && (argv[a][len - 1] == '/' || argv[a][len - 1] == '\\'))
+            {
+                len--;
+            }
+            
+            memcpy(pattern, argv[a], len);
+            strcpy(pattern + len, PFS_DIR_PATTERN);
+            rc = file_glob(pattern, &paths);
+        }
+        else
+        {
+            rc = file_glob(argv[a], &paths);
+        }
+    }
+    
+    if (!rc)
+        rc = batch_unique_paths(&paths);
+    
+    count = array_count(&paths);
+    
+    if (rc)
+    {
+        output(stderr, "Could not list archives: %s\n", errmsg(rc));
+        goto abort;
+    }
+    
+    if (count == 0)
+    {
+        output(stderr, "No " PFS_EXT " archives found\n");
+        rc = ERR_Invalid;
+        goto abort;
+    }
+    
+    patches = alloc_array_type(count, Patch);
+    
+    if (!patches)
+    {
+        output(stderr, "Could not start: %s\n", errmsg(ERR_OutOfMemory));
+        rc = ERR_OutOfMemory;
+        goto abort;
+    }
+    
+    for (i = 0; i < count; i++)
+    {
+        Buffer** path = array_get(&paths, i, Buffer*);
+        patch_init(&patches[i], buf_str(*path), rules, true);
+    }
+    
+    output(stdout, "Patching up to %u archives on %u threads...\n", count, threads);
+    
+    start = time_now();
+    thread_parallel_for(count, threads, batch_worker, patches);
+    batch_report(patches, count, threads, time_now() - start);
+    
+    for (i = 0; i < count; i++)
+    {
+        if (!patches[i].skipped && patches[i].rc)
+            failed++;
+    }
+    
+    rc = (failed) ? ERR_Generic : ERR_None;
+    
+abort:
+    for (i = 0; i < count; i++)
+    {
+        Buffer** path = array_get(&paths, i, Buffer*);
+        buf_destroy(*path);
+    }
+    
+    array_deinit(&paths, NULL);
+    if (patches) free(patches);
+    return rc;
+}
+
+int main(int argc, char** argv)
+{
+    WldRuleSet rules;
+    Patch patch;
+    int rc;
+    
+    ruleset_init(&rules);
+    rc = ruleset_add_list(&rules, patchRules, sizeof(patchRules) / sizeof(patchRules[0]));
+    
+    if (rc)
+    {
+        output(stderr, "Could not start: %s\n", errmsg(rc));
+        ruleset_deinit(&rules);
+        return EXIT_FAILURE;
+    }
+    
+    if (argc > 1)
+    {
+        rc = batch_run(argc, argv, &rules);
+        ruleset_deinit(&rules);
+        return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    
+    rc = patch_init(&patch, TARGET_PFS, &rules, false);
+    
+    if (!rc)
+        rc = patch_run(&patch);
+    
+    ruleset_deinit(&rules);
     
     if (rc)
         output(stderr, "Aborting\n");
     else
         output(stdout, "Success\n");
     
-    pfs_close(&pfs);
-    
 #ifdef PLATFORM_WINDOWS
     output(stdout, "\nPress a key to exit...\n");
     getchar();
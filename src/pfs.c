@@ -2,6 +2,7 @@
 #include "pfs.h"
 
 static Buffer* pfs_decompress(Pfs* pfs, uint32_t i);
+static Buffer* pfs_inflate(Pfs* pfs, const byte* src, uint32_t dlen, uint32_t ilen);
 
 typedef struct PfsHeader {
     uint32_t    offset;
@@ -20,6 +21,33 @@ typedef struct PfsFileEntry {
     uint32_t    inflatedLen;
 } PfsFileEntry;
 
+typedef struct PfsCrcRef {
+    uint32_t    crc;
+    uint32_t    index;
+} PfsCrcRef;
+
+typedef struct PfsBlockJob {
+    const byte* src;
+    byte*       dst;
+    uint32_t    deflatedLen;
+    uint32_t    inflatedLen;
+    bool        reuse;      /* src is an already-compressed block from the source archive */
+} PfsBlockJob;
+
+typedef struct PfsSrcBlock {
+    uint32_t    inflatedOffset;
+    uint32_t    inflatedLen;
+    uint32_t    deflatedOffset; /* Of the compressed bytes, relative to the start of the entry */
+    uint32_t    deflatedLen;
+} PfsSrcBlock;
+
+typedef struct PfsBlockJobs {
+    Array           jobs;
+    CodecCtx**      codecs;     /* Indexed by worker */
+    PfsCompression  compression;
+    volatile int    failed;
+} PfsBlockJobs;
+
 typedef struct PfsEntry {
     uint32_t    crc;
     uint32_t    offset;
@@ -27,20 +55,94 @@ typedef struct PfsEntry {
     uint32_t    deflatedLen;
     Buffer*     name;
     Array       replacement;
+    Array       blocks;         /* PfsSrcBlock over the current compressed bytes; built by the first range read */
+    Buffer*     cached;         /* Shared copy of the inflated contents, while in the cache */
+    uint32_t    lruPrev;
+    uint32_t    lruNext;
+    /* What the entry looked like in the source archive, for spotting puts that change nothing */
+    uint32_t    srcInflatedLen;
+    uint32_t    srcDeflatedLen;
+    uint64_t    srcHash;
+    bool        fromSource;
+    bool        srcHashed;
+    bool        srcValidated;   /* Block chain walked and srcDeflatedLen exact; see PFS_OPEN_Fast */
+    bool        customPolicy;
+    bool        replaced;       /* Put since the archive was opened: replacement holds all of its compressed bytes, even if that's none */
+    uint32_t    blocksCompressed; /* Making up the replacement, for the next save's stats */
+    uint32_t    blocksReused;
 } PfsEntry;
 
+#define PFS_NONE 0xffffffff
+
 static void pfs_init(Pfs* pfs)
 {
     memset(pfs, 0, sizeof(Pfs));
     
     array_init(&pfs->entries, PfsEntry);
+    array_init(&pfs->codecs, CodecCtx*);
+    array_init(&pfs->byCrc, PfsCrcRef);
     tbl_init(&pfs->byName, uint32_t);
+    
+    pfs->threadCount = thread_cpu_count();
+    pfs->lruHead = PFS_NONE;
+    pfs->lruTail = PFS_NONE;
+    pfs_set_compression_preset(pfs, PFS_COMPRESS_Max);
+}
+
+void pfs_set_threads(Pfs* pfs, uint32_t count)
+{
+    if (!count)
+        count = thread_cpu_count();
+    
+    if (count != pfs->threadCount)
+    {
+        thread_pool_destroy(pfs->pool);
+        pfs->pool = NULL;
+    }
+    
+    pfs->threadCount = count;
+}
+
+void pfs_set_incremental(Pfs* pfs, bool enable)
+{
+    pfs->incremental = enable;
+}
+
+static int pfs_compression_valid(int level, int strategy)
+{
+    return (level >= CODEC_LEVEL_Store && level <= CODEC_LEVEL_Best && strategy >= 0 && strategy < CODEC_STRATEGY_COUNT);
+}
+
+int pfs_set_compression(Pfs* pfs, int level, int strategy)
+{
+    if (!pfs_compression_valid(level, strategy))
+        return ERR_Invalid;
+    
+    pfs->compression.level = level;
+    pfs->compression.strategy = strategy;
+    return ERR_None;
+}
+
+void pfs_set_compression_preset(Pfs* pfs, int preset)
+{
+    switch (preset)
+    {
+    case PFS_COMPRESS_Fast:
+        pfs_set_compression(pfs, CODEC_LEVEL_Fastest, CODEC_STRATEGY_Default);
+        break;
+    
+    default:
+        pfs_set_compression(pfs, CODEC_LEVEL_Best, CODEC_STRATEGY_Default);
+        break;
+    }
 }
 
 static void pfs_destroy_entry(void* ptr)
 {
     PfsEntry* ent = (PfsEntry*)ptr;
     array_deinit(&ent->replacement, NULL);
+    array_deinit(&ent->blocks, NULL);
+    buf_release(ent->cached);
     
     if (ent->name)
     {
@@ -49,16 +151,20 @@ static void pfs_destroy_entry(void* ptr)
     }
 }
 
+static void pfs_destroy_codec(void* ptr)
+{
+    codec_ctx_destroy(*(CodecCtx**)ptr);
+}
+
 void pfs_close(Pfs* pfs)
 {
     array_deinit(&pfs->entries, pfs_destroy_entry);
+    array_deinit(&pfs->codecs, pfs_destroy_codec);
+    array_deinit(&pfs->byCrc, NULL);
     tbl_deinit(&pfs->byName, NULL);
-    
-    if (pfs->raw)
-    {
-        buf_destroy(pfs->raw);
-        pfs->raw = NULL;
-    }
+    fmap_close(&pfs->raw);
+    thread_pool_destroy(pfs->pool);
+    pfs->pool = NULL;
     
     if (pfs->path)
     {
@@ -75,25 +181,69 @@ static int pfs_cmp(const void* va, const void* vb)
     return a->offset < b->offset;
 }
 
+static int pfs_crc_ref_cmp(const void* va, const void* vb)
+{
+    PfsCrcRef* a = (PfsCrcRef*)va;
+    PfsCrcRef* b = (PfsCrcRef*)vb;
+    
+    return (a->crc < b->crc) || (a->crc == b->crc && a->index < b->index);
+}
+
+/* The CRCs in the directory cover each name's null terminator as well */
+static uint32_t pfs_name_crc(const char* name, uint32_t len)
+{
+    static const byte terminator = 0;
+    return crc_update(crc_calc(name, len), &terminator, 1);
+}
+
+/* Walks the block headers of an entry to find how many compressed bytes it spans */
+static int pfs_chain_length(const byte* data, uint32_t len, uint32_t offset, uint32_t inflatedLen, uint32_t* out)
+{
+    uint32_t p = offset;
+    uint32_t ilen = 0;
+    
+    while (ilen < inflatedLen)
+    {
+        const PfsBlock* block = (const PfsBlock*)(data + p);
+        
+        if (p > len || sizeof(PfsBlock) > len - p) return ERR_OutOfBounds;
+        
+        p += sizeof(PfsBlock);
+        
+        if (block->deflatedLen > len - p) return ERR_OutOfBounds;
+        
+        p += block->deflatedLen;
+        ilen += block->inflatedLen;
+    }
+    
+    *out = p - offset;
+    return ERR_None;
+}
+
 int pfs_open(Pfs* pfs, const char* path)
 {
-    Buffer* file;
+    return pfs_open_flags(pfs, path, PFS_OPEN_Default);
+}
+
+int pfs_open_flags(Pfs* pfs, const char* path, int flags)
+{
     uint32_t len;
-    byte* data;
+    const byte* data;
     uint32_t p, n, i;
-    PfsHeader* h;
-    Buffer* nameData;
+    uint32_t dirOffset;
+    const PfsHeader* h;
+    PfsEntry* back;
+    int rc;
     
     pfs_init(pfs);
     
-    file = buf_from_file(path);
+    rc = (flags & PFS_OPEN_NoMap) ? fmap_read(&pfs->raw, path) : fmap_open(&pfs->raw, path);
     
-    if (!file) return ERR_CouldNotOpen;
+    if (rc) return rc;
     
-    len = buf_length(file);
-    data = buf_writable(file);
+    len = fmap_length(&pfs->raw);
+    data = fmap_data(&pfs->raw);
     
-    pfs->raw = file;
     pfs->path = buf_create(path, strlen(path));
     
     if (!pfs->path) return ERR_OutOfMemory;
@@ -102,24 +252,23 @@ int pfs_open(Pfs* pfs, const char* path)
     
     if (p > len) goto bad_size;
     
-    h = (PfsHeader*)data;
+    h = (const PfsHeader*)data;
     
     if (memcmp(&h->signature, "PFS ", sizeof(uint32_t)) != 0)
         return ERR_Invalid;
     
-    p = h->offset;
+    p = dirOffset = h->offset;
     
-    if (p > len) goto bad_size;
+    if (p > len - sizeof(uint32_t)) goto bad_size;
     
     n = *(uint32_t*)(data + p);
     p += sizeof(uint32_t);
     
     for (i = 0; i < n; i++)
     {
-        PfsFileEntry* src = (PfsFileEntry*)(data + p);
+        const PfsFileEntry* src = (const PfsFileEntry*)(data + p);
         PfsEntry ent;
         uint32_t memPos;
-        uint32_t ilen, totalLen;
         uint32_t offset;
         
         memPos = p + sizeof(PfsFileEntry);
@@ -133,27 +282,32 @@ int pfs_open(Pfs* pfs, const char* path)
         ent.inflatedLen = src->inflatedLen;
         ent.name = NULL;
         array_init(&ent.replacement, byte);
+        array_init(&ent.blocks, PfsSrcBlock);
         
-        p = offset;
-        ilen = 0;
-        totalLen = src->inflatedLen;
+        ent.deflatedLen = 0;
+        ent.srcValidated = false;
         
-        while (ilen < totalLen)
+        /* In fast mode the deflated length comes from the gap to the next entry, once they're sorted */
+        if (flags & PFS_OPEN_Fast)
         {
-            PfsBlock* block = (PfsBlock*)(data + p);
-            
-            p += sizeof(PfsBlock);
-            
-            if (p > len) goto bad_size;
-            
-            p += block->deflatedLen;
-            
-            if (p > len) goto bad_size;
-            
-            ilen += block->inflatedLen;
+            if (offset > dirOffset) goto bad_size;
+        }
+        else
+        {
+            rc = pfs_chain_length(data, len, offset, ent.inflatedLen, &ent.deflatedLen);
+            if (rc) return rc;
+            ent.srcValidated = true;
         }
         
-        ent.deflatedLen = p - offset;
+        ent.srcInflatedLen = ent.inflatedLen;
+        ent.srcDeflatedLen = ent.deflatedLen;
+        ent.srcHash = 0;
+        ent.fromSource = true;
+        ent.srcHashed = false;
+        ent.cached = NULL;
+        ent.replaced = false;
+        ent.blocksCompressed = 0;
+        ent.blocksReused = 0;
         
         p = memPos;
         
@@ -166,22 +320,76 @@ int pfs_open(Pfs* pfs, const char* path)
     
     n = array_count(&pfs->entries);
     
+    if (flags & PFS_OPEN_Fast)
+    {
+        for (i = 0; i < n; i++)
+        {
+            PfsEntry* ent = array_get(&pfs->entries, i, PfsEntry);
+            PfsEntry* next = array_get(&pfs->entries, i + 1, PfsEntry);
+            
+            ent->deflatedLen = ((next) ? next->offset : dirOffset) - ent->offset;
+            ent->srcDeflatedLen = ent->deflatedLen;
+        }
+    }
+    
     if (n == 0)
         return ERR_Invalid;
     
+    /* The name table is the last entry; it is only inflated once something needs it */
+    back = array_back(&pfs->entries, PfsEntry);
+    pfs->namesOffset = back->offset;
+    pfs->namesDeflatedLen = back->deflatedLen;
+    pfs->namesInflatedLen = back->inflatedLen;
+    array_pop_back(&pfs->entries);
     n--;
-    nameData = pfs_decompress(pfs, n);
     
-    if (!nameData) return ERR_OutOfMemory;
+    if (array_reserve(&pfs->byCrc, n))
+        return ERR_OutOfMemory;
     
-    array_pop_back(&pfs->entries);
+    for (i = 0; i < n; i++)
+    {
+        PfsEntry* ent = array_get(&pfs->entries, i, PfsEntry);
+        PfsCrcRef ref;
+        
+        ref.crc = ent->crc;
+        ref.index = i;
+        
+        array_push_back(&pfs->byCrc, &ref);
+    }
+    
+    if (array_sort(&pfs->byCrc, pfs_crc_ref_cmp))
+        return ERR_OutOfMemory;
+    
+    return ERR_None;
+    
+bad_size:
+    return ERR_OutOfBounds;
+}
+
+static int pfs_load_names(Pfs* pfs)
+{
+    const byte* data = fmap_data(&pfs->raw);
+    Buffer* nameData;
+    byte* names;
+    uint32_t dlen, len, p, n, i;
+    int rc;
+    
+    if (pfs->namesLoaded)
+        return ERR_None;
+    
+    rc = pfs_chain_length(data, pfs->namesOffset + pfs->namesDeflatedLen, pfs->namesOffset, pfs->namesInflatedLen, &dlen);
+    if (rc) return rc;
+    
+    nameData = pfs_inflate(pfs, data + pfs->namesOffset, dlen, pfs->namesInflatedLen);
+    
+    if (!nameData) return ERR_Compression;
     
     len = buf_length(nameData);
-    data = buf_writable(nameData);
+    names = buf_writable(nameData);
     
     if (len < sizeof(uint32_t)) goto bad_name;
     
-    n = *(uint32_t*)data;
+    n = *(uint32_t*)names;
     p = sizeof(uint32_t);
     
     for (i = 0; i < n; i++)
@@ -189,14 +397,13 @@ int pfs_open(Pfs* pfs, const char* path)
         PfsEntry* ent;
         uint32_t namelen;
         const char* name;
-        int rc;
         
         if ((p + sizeof(uint32_t)) > len) goto bad_name;
         
-        namelen = *(uint32_t*)(data + p);
+        namelen = *(uint32_t*)(names + p);
         p += sizeof(uint32_t);
         
-        name = (const char*)(data + p);
+        name = (const char*)(names + p);
         p += namelen;
         
         if (p > len) goto bad_name;
@@ -212,185 +419,1053 @@ int pfs_open(Pfs* pfs, const char* path)
         if (!ent->name)
         {
             rc = ERR_OutOfMemory;
-            goto name_dest;
+            goto abort;
         }
         
         rc = tbl_set_str(&pfs->byName, name, namelen - 1, &i);
-        
-        if (rc)
-        {
-        name_dest:
-            buf_destroy(nameData);
-            return rc;
-        }
+        if (rc) goto abort;
     }
     
     buf_destroy(nameData);
+    
+    pfs->namesLoaded = true;
+    array_deinit(&pfs->byCrc, NULL);
     return ERR_None;
     
 bad_name:
+    rc = ERR_OutOfBounds;
+abort:
+    /* Nothing has a name until the table is loaded, so whatever this attempt added goes, and the next
+       one starts over rather than finding its names already in the table */
+    for (i = 0; i < array_count(&pfs->entries); i++)
+    {
+        PfsEntry* ent = array_get(&pfs->entries, i, PfsEntry);
+        
+        if (ent->name)
+        {
+            buf_destroy(ent->name);
+            ent->name = NULL;
+        }
+    }
+    
+    tbl_deinit(&pfs->byName, NULL);
+    tbl_init(&pfs->byName, uint32_t);
     buf_destroy(nameData);
-bad_size:
-    return ERR_OutOfBounds;
+    return rc;
 }
 
-static byte* pfs_data(Pfs* pfs)
+static const byte* pfs_data(Pfs* pfs)
 {
-    return buf_writable(pfs->raw);
+    return fmap_data(&pfs->raw);
 }
 
-static Buffer* pfs_decompress(Pfs* pfs, uint32_t i)
+/* Makes sure workers [0, count) each have a codec context; they are kept for the life of the Pfs */
+static CodecCtx** pfs_codecs(Pfs* pfs, uint32_t count)
 {
-    PfsEntry* ent = array_get(&pfs->entries, i, PfsEntry);
-    byte* src;
-    byte* dst;
-    uint32_t ilen;
-    uint32_t read;
-    uint32_t pos;
-    Buffer* buf;
+    while (array_count(&pfs->codecs) < count)
+    {
+        CodecCtx* codec = codec_ctx_create();
+        
+        if (!codec) return NULL;
+        
+        if (!array_push_back(&pfs->codecs, &codec))
+        {
+            codec_ctx_destroy(codec);
+            return NULL;
+        }
+    }
     
-    if (!ent) return NULL;
+    return array_data(&pfs->codecs, CodecCtx*);
+}
+
+/* The pool is started the first time a job wants more than one worker, and kept until the Pfs is
+   closed or given a different thread count. Without one, the job still runs, on threads of its own */
+static void pfs_parallel_for(Pfs* pfs, uint32_t count, uint32_t workers, ParallelCallback func, void* ud)
+{
+    if (workers > 1 && !pfs->pool)
+        pfs->pool = thread_pool_create(pfs->threadCount - 1);
     
-    src = pfs_data(pfs) + ent->offset;
-    ilen = ent->inflatedLen;
-    read = 0;
-    pos = 0;
-    buf = buf_create(NULL, ilen);
+    if (workers > 1 && pfs->pool)
+        thread_pool_for(pfs->pool, count, workers, func, ud);
+    else
+        thread_parallel_for(count, workers, func, ud);
+}
+
+#define PFS_PARALLEL_INFLATE_MIN KILOBYTES(256) /* Smaller entries aren't worth waking up other threads for */
+
+static void pfs_inflate_block(void* ud, uint32_t index, uint32_t worker)
+{
+    PfsBlockJobs* ctx = (PfsBlockJobs*)ud;
+    PfsBlockJob* job = array_get(&ctx->jobs, index, PfsBlockJob);
+    uint32_t len = job->inflatedLen;
+    int rc;
     
-    if (!buf) return NULL;
+    if (ctx->failed) return;
+    
+    rc = codec_ctx_inflate(ctx->codecs[worker], job->dst, &len, job->src, job->deflatedLen);
+    
+    if (rc || len != job->inflatedLen)
+        ctx->failed = true;
+}
+
+static int pfs_inflate_parallel(Pfs* pfs, const byte* src, uint32_t dlen, byte* dst, uint32_t ilen)
+{
+    PfsBlockJobs ctx;
+    uint32_t read = 0;
+    uint32_t pos = 0;
+    int rc = ERR_None;
+    
+    array_init(&ctx.jobs, PfsBlockJob);
+    ctx.codecs = pfs_codecs(pfs, pfs->threadCount);
+    ctx.failed = false;
     
-    dst = buf_writable(buf);
+    if (!ctx.codecs)
+        return ERR_OutOfMemory;
     
+    /* Prefix scan over the block headers to find where each block inflates to */
     while (read < ilen)
     {
-        PfsBlock* block = (PfsBlock*)(src + pos);
-        unsigned long len;
-        int rc;
+        const PfsBlock* block = (const PfsBlock*)(src + pos);
+        PfsBlockJob job;
         
         pos += sizeof(PfsBlock);
         
-        len = ilen - read;
-        rc = uncompress(dst + read, &len, src + pos, block->deflatedLen);
+        if (pos > dlen || block->deflatedLen > dlen - pos || block->inflatedLen > ilen - read || block->inflatedLen == 0)
+            goto invalid;
+        
+        job.src = src + pos;
+        job.dst = dst + read;
+        job.deflatedLen = block->deflatedLen;
+        job.inflatedLen = block->inflatedLen;
         
-        if (rc != Z_OK) goto fail;
+        if (!array_push_back(&ctx.jobs, &job))
+        {
+            rc = ERR_OutOfMemory;
+            goto abort;
+        }
         
         read += block->inflatedLen;
         pos += block->deflatedLen;
     }
     
-    return buf;
+    pfs_parallel_for(pfs, array_count(&ctx.jobs), pfs->threadCount, pfs_inflate_block, &ctx);
+    
+    if (ctx.failed)
+        rc = ERR_Compression;
+    
+abort:
+    array_deinit(&ctx.jobs, NULL);
+    return rc;
     
-fail:
-    buf_destroy(buf);
-    return NULL;
+invalid:
+    rc = ERR_Invalid;
+    goto abort;
 }
 
-static int pfs_index_by_name(Pfs* pfs, const char* name, uint32_t len)
+/* Entries opened with PFS_OPEN_Fast only know the span up to whatever follows them; their block
+   chain is checked, and the length trimmed to it, the first time their source bytes are needed */
+static int pfs_validate_entry(Pfs* pfs, PfsEntry* ent)
 {
-    uint32_t* index;
+    uint32_t dlen;
+    int rc;
     
-    if (len == 0)
-        len = strlen(name);
+    if (ent->srcValidated || !ent->fromSource)
+        return ERR_None;
     
-    index = tbl_get_str(&pfs->byName, name, len, uint32_t);
+    rc = pfs_chain_length(pfs_data(pfs), ent->offset + ent->srcDeflatedLen, ent->offset, ent->srcInflatedLen, &dlen);
+    if (rc) return rc;
     
-    return (index) ? (int)*index : -1;
+    if (!ent->replaced)
+        ent->deflatedLen = dlen;
+    
+    ent->srcDeflatedLen = dlen;
+    ent->srcValidated = true;
+    return ERR_None;
 }
 
-Buffer* pfs_get(Pfs* pfs, const char* name, uint32_t len)
+static const byte* pfs_entry_data(Pfs* pfs, PfsEntry* ent)
 {
-    int index = pfs_index_by_name(pfs, name, len);
-    
-    if (index < 0) return NULL;
-    
-    return pfs_decompress(pfs, (uint32_t)index);
+    return (ent->replaced) ? array_raw(&ent->replacement) : pfs_data(pfs) + ent->offset;
 }
 
-static PfsEntry* pfs_get_or_append_entry(Pfs* pfs, const char* name, uint32_t len)
+static int pfs_inflate_serial(CodecCtx* codec, const byte* src, uint32_t dlen, byte* dst, uint32_t ilen)
 {
-    int index = pfs_index_by_name(pfs, name, len);
-    PfsEntry* ent;
-    PfsEntry dst;
+    uint32_t read = 0;
+    uint32_t pos = 0;
     
-    if (index >= 0)
-        return array_get(&pfs->entries, (uint32_t)index, PfsEntry);
-    
-    /* Need to add a new entry */
-    memset(&dst, 0, sizeof(PfsEntry));
+    while (read < ilen)
+    {
+        const PfsBlock* block = (const PfsBlock*)(src + pos);
+        uint32_t len;
+        int rc;
+        
+        if (pos > dlen || sizeof(PfsBlock) > dlen - pos) return ERR_Invalid;
+        
+        pos += sizeof(PfsBlock);
+        
+        if (block->deflatedLen > dlen - pos) return ERR_Invalid;
+        
+        len = ilen - read;
+        rc = codec_ctx_inflate(codec, dst + read, &len, src + pos, block->deflatedLen);
+        
+        if (rc) return rc;
+        
+        read += block->inflatedLen;
+        pos += block->deflatedLen;
+    }
     
-    if (len == 0)
-        len = strlen(name);
+    return ERR_None;
+}
+
+static int pfs_inflate_into(Pfs* pfs, const byte* src, uint32_t dlen, byte* dst, uint32_t ilen)
+{
+    CodecCtx** codecs;
     
-    dst.crc = crc_calc(name, len);
-    dst.name = buf_create(name, len);
-    array_init(&dst.replacement, byte);
+    /* Blocks are independent zlib streams, so big entries can be inflated concurrently. If anything
+       about the block chain looks off, fall back to the serial path and let it be the judge */
+    if (ilen >= PFS_PARALLEL_INFLATE_MIN && pfs->threadCount > 1)
+    {
+        if (pfs_inflate_parallel(pfs, src, dlen, dst, ilen) == ERR_None)
+            return ERR_None;
+    }
     
-    if (!dst.name) return NULL;
+    codecs = pfs_codecs(pfs, 1);
+    if (!codecs) return ERR_OutOfMemory;
     
-    index = array_count(&pfs->entries);
-    ent = array_push_back_type(&pfs->entries, &dst, PfsEntry);
+    return pfs_inflate_serial(codecs[0], src, dlen, dst, ilen);
+}
+
+static Buffer* pfs_inflate(Pfs* pfs, const byte* src, uint32_t dlen, uint32_t ilen)
+{
+    Buffer* buf = buf_create(NULL, ilen);
     
-    if (!ent) return NULL;
+    if (!buf) return NULL;
     
-    /* Add the new entry to the hash table */
-    if (tbl_set_str(&pfs->byName, name, len, &index))
+    if (pfs_inflate_into(pfs, src, dlen, buf_writable(buf), ilen))
     {
-        array_pop_back(&pfs->entries);
+        buf_destroy(buf);
         return NULL;
     }
     
-    return ent;
+    return buf;
 }
 
-#define PFS_COMPRESS_INPUT_SIZE 8192
-#define PFS_COMPRESS_BUF_SIZE (PFS_COMPRESS_INPUT_SIZE + 128) /* Overflow space for things that can't be compressed any further... */
+static Buffer* pfs_decompress(Pfs* pfs, uint32_t i)
+{
+    PfsEntry* ent = array_get(&pfs->entries, i, PfsEntry);
+    
+    if (!ent || pfs_validate_entry(pfs, ent)) return NULL;
+    
+    return pfs_inflate(pfs, pfs_entry_data(pfs, ent), ent->deflatedLen, ent->inflatedLen);
+}
 
-static int pfs_compress(PfsEntry* ent, const void* data, uint32_t len)
+static int pfs_index_by_name(Pfs* pfs, const char* name, uint32_t len)
 {
-    const byte* ptr = (const byte*)data;
-    byte tmp[PFS_COMPRESS_BUF_SIZE];
+    uint32_t* index;
     
-    ent->inflatedLen = len;
+    if (len == 0)
+        len = strlen(name);
     
-    while (len > 0)
+    /* Until something needs the name table, the directory's CRCs answer lookups: a single match is
+       taken to be the entry. A miss or a collision falls back to the names, in case the archive's
+       CRCs weren't made quite the usual way */
+    if (!pfs->namesLoaded)
     {
-        uint32_t r = (len < PFS_COMPRESS_INPUT_SIZE) ? len : PFS_COMPRESS_INPUT_SIZE;
-        unsigned long dstlen;
-        PfsBlock block;
-        int rc;
-        
-        block.inflatedLen = r;
-        dstlen = sizeof(tmp);
-        
-        rc = compress2(tmp, &dstlen, ptr, r, Z_BEST_COMPRESSION);
-        
-        if (rc != Z_OK) return ERR_Compression;
+        PfsCrcRef* refs = array_data(&pfs->byCrc, PfsCrcRef);
+        uint32_t crc = pfs_name_crc(name, len);
+        uint32_t lo = 0;
+        uint32_t hi = array_count(&pfs->byCrc);
         
-        block.deflatedLen = dstlen;
+        while (lo < hi)
+        {
+            uint32_t mid = lo + (hi - lo) / 2;
+            
+            if (refs[mid].crc < crc)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
         
-        if (array_append(&ent->replacement, &block, sizeof(block)) || array_append(&ent->replacement, tmp, dstlen))
-            return ERR_OutOfMemory;
+        if (lo < array_count(&pfs->byCrc) && refs[lo].crc == crc && (lo + 1 == array_count(&pfs->byCrc) || refs[lo + 1].crc != crc))
+            return (int)refs[lo].index;
         
-        len -= r;
-        ptr += r;
+        if (pfs_load_names(pfs))
+            return -1;
     }
     
-    ent->deflatedLen = array_count(&ent->replacement);
+    index = tbl_get_str(&pfs->byName, name, len, uint32_t);
     
-    return ERR_None;
+    return (index) ? (int)*index : -1;
 }
 
-int pfs_put(Pfs* pfs, const char* name, uint32_t namelen, const void* data, uint32_t datalen)
+static void pfs_lru_unlink(Pfs* pfs, PfsEntry* ent)
+{
+    PfsEntry* prev = (ent->lruPrev != PFS_NONE) ? array_get(&pfs->entries, ent->lruPrev, PfsEntry) : NULL;
+    PfsEntry* next = (ent->lruNext != PFS_NONE) ? array_get(&pfs->entries, ent->lruNext, PfsEntry) : NULL;
+    
+    if (prev)
+        prev->lruNext = ent->lruNext;
+    else
+        pfs->lruHead = ent->lruNext;
+    
+    if (next)
+        next->lruPrev = ent->lruPrev;
+    else
+        pfs->lruTail = ent->lruPrev;
+}
+
+static void pfs_lru_push(Pfs* pfs, PfsEntry* ent, uint32_t index)
 {
-    PfsEntry* ent = pfs_get_or_append_entry(pfs, name, namelen);
+    PfsEntry* tail = (pfs->lruTail != PFS_NONE) ? array_get(&pfs->entries, pfs->lruTail, PfsEntry) : NULL;
     
-    if (!ent) return ERR_OutOfMemory;
+    ent->lruPrev = pfs->lruTail;
+    ent->lruNext = PFS_NONE;
     
-    array_clear(&ent->replacement);
-    return pfs_compress(ent, data, datalen);
+    if (tail)
+        tail->lruNext = index;
+    else
+        pfs->lruHead = index;
+    
+    pfs->lruTail = index;
 }
 
-static int pfs_crc_cmp(const void* va, const void* vb)
+static void pfs_cache_drop(Pfs* pfs, uint32_t index)
+{
+    PfsEntry* ent = array_get(&pfs->entries, index, PfsEntry);
+    
+    if (!ent || !ent->cached) return;
+    
+    pfs_lru_unlink(pfs, ent);
+    pfs->cacheStats.entries--;
+    pfs->cacheStats.bytes -= buf_length(ent->cached);
+    buf_release(ent->cached);
+    ent->cached = NULL;
+}
+
+static void pfs_cache_trim(Pfs* pfs, uint32_t limit)
+{
+    while (pfs->lruHead != PFS_NONE && pfs->cacheStats.bytes > limit)
+    {
+        pfs_cache_drop(pfs, pfs->lruHead);
+        pfs->cacheStats.evictions++;
+    }
+}
+
+void pfs_set_cache(Pfs* pfs, uint32_t maxBytes)
+{
+    pfs->cacheLimit = maxBytes;
+    pfs_cache_trim(pfs, maxBytes);
+}
+
+Buffer* pfs_get_shared(Pfs* pfs, const char* name, uint32_t len)
+{
+    int index = pfs_index_by_name(pfs, name, len);
+    PfsEntry* ent;
+    Buffer* buf;
+    
+    if (index < 0) return NULL;
+    
+    ent = array_get(&pfs->entries, (uint32_t)index, PfsEntry);
+    
+    if (ent->cached)
+    {
+        pfs->cacheStats.hits++;
+        pfs_lru_unlink(pfs, ent);
+        pfs_lru_push(pfs, ent, (uint32_t)index);
+        return buf_retain(ent->cached);
+    }
+    
+    if (pfs_validate_entry(pfs, ent)) return NULL;
+    
+    buf = buf_create_shared(NULL, ent->inflatedLen);
+    
+    if (!buf) return NULL;
+    
+    if (pfs_inflate_into(pfs, pfs_entry_data(pfs, ent), ent->deflatedLen, buf_writable(buf), ent->inflatedLen))
+    {
+        buf_release(buf);
+        return NULL;
+    }
+    
+    if (!pfs->cacheLimit)
+        return buf;
+    
+    pfs->cacheStats.misses++;
+    
+    /* Anything bigger than the whole cache just isn't kept */
+    if (ent->inflatedLen <= pfs->cacheLimit)
+    {
+        pfs_cache_trim(pfs, pfs->cacheLimit - ent->inflatedLen);
+        
+        ent->cached = buf_retain(buf);
+        pfs_lru_push(pfs, ent, (uint32_t)index);
+        pfs->cacheStats.entries++;
+        pfs->cacheStats.bytes += ent->inflatedLen;
+    }
+    
+    return buf;
+}
+
+Buffer* pfs_get(Pfs* pfs, const char* name, uint32_t len)
+{
+    int index = pfs_index_by_name(pfs, name, len);
+    PfsEntry* ent;
+    
+    if (index < 0) return NULL;
+    
+    ent = array_get(&pfs->entries, (uint32_t)index, PfsEntry);
+    
+    /* Callers own what pfs_get returns, so a cached entry is handed out as a copy. A miss inflates
+       straight into the caller's buffer, and leaves filling the cache to pfs_get_shared */
+    if (ent->cached)
+    {
+        pfs->cacheStats.hits++;
+        pfs_lru_unlink(pfs, ent);
+        pfs_lru_push(pfs, ent, (uint32_t)index);
+        return buf_create(buf_data(ent->cached), buf_length(ent->cached));
+    }
+    
+    if (pfs->cacheLimit)
+        pfs->cacheStats.misses++;
+    
+    return pfs_decompress(pfs, (uint32_t)index);
+}
+
+int pfs_get_into(Pfs* pfs, const char* name, uint32_t len, void* dst, uint32_t dstlen, uint32_t* outlen)
+{
+    int index = pfs_index_by_name(pfs, name, len);
+    PfsEntry* ent;
+    int rc;
+    
+    if (index < 0) return ERR_Invalid;
+    
+    ent = array_get(&pfs->entries, (uint32_t)index, PfsEntry);
+    *outlen = ent->inflatedLen;
+    
+    if (dstlen < ent->inflatedLen)
+        return ERR_OutOfSpace;
+    
+    rc = pfs_validate_entry(pfs, ent);
+    if (rc) return rc;
+    
+    return pfs_inflate_into(pfs, pfs_entry_data(pfs, ent), ent->deflatedLen, (byte*)dst, ent->inflatedLen);
+}
+
+int pfs_reader_open(PfsReader* rd, Pfs* pfs, const char* name, uint32_t len)
+{
+    int index = pfs_index_by_name(pfs, name, len);
+    PfsEntry* ent;
+    int rc;
+    
+    memset(rd, 0, sizeof(PfsReader));
+    
+    if (index < 0) return ERR_Invalid;
+    
+    ent = array_get(&pfs->entries, (uint32_t)index, PfsEntry);
+    
+    rc = pfs_validate_entry(pfs, ent);
+    if (rc) return rc;
+    
+    rd->pfs = pfs;
+    rd->src = pfs_entry_data(pfs, ent);
+    rd->deflatedLen = ent->deflatedLen;
+    rd->inflatedLen = ent->inflatedLen;
+    return ERR_None;
+}
+
+int pfs_reader_next(PfsReader* rd, void* dst, uint32_t dstlen, uint32_t* outlen)
+{
+    const PfsBlock* block;
+    CodecCtx** codecs;
+    uint32_t avail;
+    uint32_t got;
+    int rc;
+    
+    *outlen = 0;
+    
+    if (rd->read >= rd->inflatedLen)
+        return ERR_None;
+    
+    if (rd->pos > rd->deflatedLen || sizeof(PfsBlock) > rd->deflatedLen - rd->pos)
+        return ERR_Invalid;
+    
+    block = (const PfsBlock*)(rd->src + rd->pos);
+    avail = rd->deflatedLen - rd->pos - sizeof(PfsBlock);
+    
+    if (block->deflatedLen > avail || block->inflatedLen > rd->inflatedLen - rd->read || block->inflatedLen == 0)
+        return ERR_Invalid;
+    
+    if (dstlen < block->inflatedLen)
+    {
+        *outlen = block->inflatedLen;
+        return ERR_OutOfSpace;
+    }
+    
+    codecs = pfs_codecs(rd->pfs, 1);
+    if (!codecs) return ERR_OutOfMemory;
+    
+    got = block->inflatedLen;
+    rc = codec_ctx_inflate(codecs[0], (byte*)dst, &got, rd->src + rd->pos + sizeof(PfsBlock), block->deflatedLen);
+    
+    if (rc) return rc;
+    if (got != block->inflatedLen) return ERR_Compression;
+    
+    rd->pos += sizeof(PfsBlock) + block->deflatedLen;
+    rd->read += got;
+    *outlen = got;
+    return ERR_None;
+}
+
+void pfs_reader_close(PfsReader* rd)
+{
+    memset(rd, 0, sizeof(PfsReader));
+}
+
+static int pfs_index_blocks(const byte* src, uint32_t dlen, uint32_t ilen, Array* out)
+{
+    uint32_t read = 0;
+    uint32_t pos = 0;
+    
+    while (read < ilen)
+    {
+        const PfsBlock* block = (const PfsBlock*)(src + pos);
+        PfsSrcBlock sb;
+        
+        pos += sizeof(PfsBlock);
+        
+        if (pos > dlen || block->deflatedLen > dlen - pos || block->inflatedLen > ilen - read || block->inflatedLen == 0)
+            return ERR_Invalid;
+        
+        sb.inflatedOffset = read;
+        sb.inflatedLen = block->inflatedLen;
+        sb.deflatedOffset = pos;
+        sb.deflatedLen = block->deflatedLen;
+        
+        if (!array_push_back(out, &sb))
+            return ERR_OutOfMemory;
+        
+        read += block->inflatedLen;
+        pos += block->deflatedLen;
+    }
+    
+    return ERR_None;
+}
+
+static int pfs_entry_block_index(Pfs* pfs, PfsEntry* ent)
+{
+    int rc = pfs_validate_entry(pfs, ent);
+    
+    if (rc || !array_empty(&ent->blocks))
+        return rc;
+    
+    rc = pfs_index_blocks(pfs_entry_data(pfs, ent), ent->deflatedLen, ent->inflatedLen, &ent->blocks);
+    
+    if (rc)
+        array_clear(&ent->blocks);
+    
+    return rc;
+}
+
+/* The entry's block index must already be built */
+static int pfs_read_blocks(CodecCtx* codec, PfsEntry* ent, const byte* data, uint32_t offset, uint32_t len, byte* out)
+{
+    byte scratch[PFS_BLOCK_SIZE];
+    PfsSrcBlock* blocks;
+    uint32_t lo, hi, n;
+    int rc;
+    
+    blocks = array_data(&ent->blocks, PfsSrcBlock);
+    n = array_count(&ent->blocks);
+    
+    /* First block that ends past offset */
+    lo = 0;
+    hi = n;
+    
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        
+        if (blocks[mid].inflatedOffset + blocks[mid].inflatedLen <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    
+    for (; lo < n && len > 0; lo++)
+    {
+        PfsSrcBlock* sb = &blocks[lo];
+        const byte* src = data + sb->deflatedOffset;
+        uint32_t skip = offset - sb->inflatedOffset;
+        uint32_t take = (sb->inflatedLen - skip < len) ? sb->inflatedLen - skip : len;
+        uint32_t got = sb->inflatedLen;
+        
+        /* Blocks wholly inside the range go straight to dst; the ones at either end are cut from a scratch copy */
+        if (skip == 0 && take == sb->inflatedLen)
+        {
+            rc = codec_ctx_inflate(codec, out, &got, src, sb->deflatedLen);
+        }
+        else
+        {
+            byte* tmp = (sb->inflatedLen > sizeof(scratch)) ? alloc_bytes(sb->inflatedLen) : scratch;
+            
+            if (!tmp) return ERR_OutOfMemory;
+            
+            rc = codec_ctx_inflate(codec, tmp, &got, src, sb->deflatedLen);
+            
+            if (!rc)
+                memcpy(out, tmp + skip, take);
+            
+            if (tmp != scratch)
+                free(tmp);
+        }
+        
+        if (rc) return rc;
+        if (got != sb->inflatedLen) return ERR_Compression;
+        
+        out += take;
+        offset += take;
+        len -= take;
+    }
+    
+    return ERR_None;
+}
+
+int pfs_read_range(Pfs* pfs, const char* name, uint32_t offset, uint32_t len, void* dst)
+{
+    int index = pfs_index_by_name(pfs, name, 0);
+    CodecCtx** codecs;
+    PfsEntry* ent;
+    int rc;
+    
+    if (index < 0) return ERR_Invalid;
+    
+    ent = array_get(&pfs->entries, (uint32_t)index, PfsEntry);
+    
+    if (offset > ent->inflatedLen || len > ent->inflatedLen - offset)
+        return ERR_OutOfBounds;
+    
+    rc = pfs_entry_block_index(pfs, ent);
+    if (rc) return rc;
+    
+    codecs = pfs_codecs(pfs, 1);
+    if (!codecs) return ERR_OutOfMemory;
+    
+    return pfs_read_blocks(codecs[0], ent, pfs_entry_data(pfs, ent), offset, len, (byte*)dst);
+}
+
+int pfs_fingerprint(Pfs* pfs, const char* name, uint32_t len, PfsFingerprint* out)
+{
+    int index = pfs_index_by_name(pfs, name, len);
+    PfsEntry* ent;
+    int rc;
+    
+    if (index < 0) return ERR_Invalid;
+    
+    ent = array_get(&pfs->entries, (uint32_t)index, PfsEntry);
+    rc = pfs_validate_entry(pfs, ent);
+    if (rc) return rc;
+    
+    out->hash           = hash_data64(pfs_entry_data(pfs, ent), ent->deflatedLen);
+    out->crc            = ent->crc;
+    out->inflatedLen    = ent->inflatedLen;
+    out->deflatedLen    = ent->deflatedLen;
+    return ERR_None;
+}
+
+static PfsEntry* pfs_get_or_append_entry(Pfs* pfs, const char* name, uint32_t len)
+{
+    int index;
+    PfsEntry* ent;
+    PfsEntry dst;
+    
+    /* Reads can trust a lone CRC match, but a put that did would overwrite whichever entry's name
+       happened to share the new name's CRC. Saving needs the names anyway */
+    if (pfs_load_names(pfs))
+        return NULL;
+    
+    index = pfs_index_by_name(pfs, name, len);
+    
+    if (index >= 0)
+        return array_get(&pfs->entries, (uint32_t)index, PfsEntry);
+    
+    /* Need to add a new entry */
+    memset(&dst, 0, sizeof(PfsEntry));
+    
+    if (len == 0)
+        len = strlen(name);
+    
+    dst.crc = pfs_name_crc(name, len);
+    dst.name = buf_create(name, len);
+    array_init(&dst.replacement, byte);
+    array_init(&dst.blocks, PfsSrcBlock);
+    
+    if (!dst.name) return NULL;
+    
+    index = array_count(&pfs->entries);
+    ent = array_push_back_type(&pfs->entries, &dst, PfsEntry);
+    
+    if (!ent) return NULL;
+    
+    /* Add the new entry to the hash table */
+    if (tbl_set_str(&pfs->byName, name, len, &index))
+    {
+        array_pop_back(&pfs->entries);
+        return NULL;
+    }
+    
+    return ent;
+}
+
+#define PFS_COMPRESS_INPUT_SIZE PFS_BLOCK_SIZE
+#define PFS_COMPRESS_BUF_SIZE (PFS_COMPRESS_INPUT_SIZE + 128) /* Overflow space for things that can't be compressed any further... */
+
+#define PFS_PARALLEL_DEFLATE_MIN KILOBYTES(32)
+
+static void pfs_deflate_block(void* ud, uint32_t index, uint32_t worker)
+{
+    PfsBlockJobs* ctx = (PfsBlockJobs*)ud;
+    PfsBlockJob* job = array_get(&ctx->jobs, index, PfsBlockJob);
+    uint32_t len = PFS_COMPRESS_BUF_SIZE;
+    int rc;
+    
+    if (ctx->failed || job->reuse) return;
+    
+    rc = codec_ctx_deflate(ctx->codecs[worker], job->dst, &len, job->src, job->inflatedLen, ctx->compression.level, ctx->compression.strategy);
+    
+    if (rc)
+        ctx->failed = true;
+    else
+        job->deflatedLen = len;
+}
+
+static int pfs_push_deflate_jobs(PfsBlockJobs* ctx, const byte* ptr, uint32_t len)
+{
+    while (len > 0)
+    {
+        PfsBlockJob job;
+        
+        job.src = ptr;
+        job.dst = NULL;
+        job.deflatedLen = 0;
+        job.inflatedLen = (len < PFS_COMPRESS_INPUT_SIZE) ? len : PFS_COMPRESS_INPUT_SIZE;
+        job.reuse = false;
+        
+        if (!array_push_back(&ctx->jobs, &job))
+            return ERR_OutOfMemory;
+        
+        len -= job.inflatedLen;
+        ptr += job.inflatedLen;
+    }
+    
+    return ERR_None;
+}
+
+static void pfs_block_jobs_init(PfsBlockJobs* ctx, const PfsCompression* compression)
+{
+    array_init(&ctx->jobs, PfsBlockJob);
+    ctx->codecs = NULL;
+    ctx->compression = *compression;
+    ctx->failed = false;
+}
+
+static int pfs_run_block_jobs(Pfs* pfs, PfsEntry* ent, PfsBlockJobs* ctx)
+{
+    uint32_t n = array_count(&ctx->jobs);
+    uint32_t pending = 0;
+    uint32_t inflated = 0;
+    uint32_t total = 0;
+    uint32_t workers;
+    byte* scratch;
+    uint32_t i;
+    int rc = ERR_None;
+    
+    for (i = 0; i < n; i++)
+    {
+        PfsBlockJob* job = array_get(&ctx->jobs, i, PfsBlockJob);
+        
+        if (!job->reuse)
+            pending++;
+    }
+    
+    scratch = (pending) ? alloc_bytes(pending * PFS_COMPRESS_BUF_SIZE) : NULL;
+    
+    if (pending && !scratch)
+        return ERR_OutOfMemory;
+    
+    /* Every block gets its own output slot so they can be compressed in any order... */
+    pending = 0;
+    for (i = 0; i < n; i++)
+    {
+        PfsBlockJob* job = array_get(&ctx->jobs, i, PfsBlockJob);
+        
+        if (!job->reuse)
+            job->dst = scratch + (pending++) * PFS_COMPRESS_BUF_SIZE;
+    }
+    
+    workers = (pending * PFS_COMPRESS_INPUT_SIZE >= PFS_PARALLEL_DEFLATE_MIN) ? pfs->threadCount : 1;
+    ctx->codecs = pfs_codecs(pfs, workers);
+    
+    if (!ctx->codecs)
+    {
+        rc = ERR_OutOfMemory;
+        goto abort;
+    }
+    
+    if (pending)
+        pfs_parallel_for(pfs, n, workers, pfs_deflate_block, ctx);
+    
+    if (ctx->failed)
+    {
+        rc = ERR_Compression;
+        goto abort;
+    }
+    
+    /* ...and are then stitched back together in their original order */
+    for (i = 0; i < n; i++)
+    {
+        PfsBlockJob* job = array_get(&ctx->jobs, i, PfsBlockJob);
+        total += sizeof(PfsBlock) + job->deflatedLen;
+    }
+    
+    if (array_reserve(&ent->replacement, array_count(&ent->replacement) + total))
+    {
+        rc = ERR_OutOfMemory;
+        goto abort;
+    }
+    
+    ent->blocksCompressed = 0;
+    ent->blocksReused = 0;
+    
+    for (i = 0; i < n; i++)
+    {
+        PfsBlockJob* job = array_get(&ctx->jobs, i, PfsBlockJob);
+        PfsBlock block;
+        
+        block.deflatedLen = job->deflatedLen;
+        block.inflatedLen = job->inflatedLen;
+        
+        array_append(&ent->replacement, &block, sizeof(block));
+        array_append(&ent->replacement, job->reuse ? job->src : job->dst, job->deflatedLen);
+        
+        inflated += job->inflatedLen;
+        
+        if (job->reuse)
+            ent->blocksReused++;
+        else
+            ent->blocksCompressed++;
+    }
+    
+    ent->inflatedLen = inflated;
+    ent->deflatedLen = array_count(&ent->replacement);
+    
+abort:
+    if (scratch) free(scratch);
+    return rc;
+}
+
+static int pfs_compress(Pfs* pfs, PfsEntry* ent, const void* data, uint32_t len, const PfsCompression* compression)
+{
+    PfsBlockJobs ctx;
+    int rc;
+    
+    pfs_block_jobs_init(&ctx, compression);
+    
+    rc = pfs_push_deflate_jobs(&ctx, (const byte*)data, len);
+    
+    if (!rc)
+        rc = pfs_run_block_jobs(pfs, ent, &ctx);
+    
+    array_deinit(&ctx.jobs, NULL);
+    return rc;
+}
+
+static int pfs_source_blocks(Pfs* pfs, PfsEntry* ent, Array* out)
+{
+    return pfs_index_blocks(pfs_data(pfs) + ent->offset, ent->srcDeflatedLen, ent->srcInflatedLen, out);
+}
+
+static int pfs_match_source_block(const byte* data, uint32_t len, const byte* orig, PfsSrcBlock* sb, int64_t delta, uint32_t* out)
+{
+    int64_t offset = (int64_t)sb->inflatedOffset + delta;
+    
+    if (offset < 0 || offset + sb->inflatedLen > len)
+        return false;
+    
+    if (memcmp(data + offset, orig + sb->inflatedOffset, sb->inflatedLen) != 0)
+        return false;
+    
+    *out = (uint32_t)offset;
+    return true;
+}
+
+/* Lines the new payload up against the blocks the entry had in the source archive, both from the
+   start and (if the length changed) from the end. Blocks that still inflate to exactly the same
+   bytes keep their original compressed form; only the stretches in between get recompressed */
+static int pfs_compress_incremental(Pfs* pfs, PfsEntry* ent, const void* data, uint32_t len, const PfsCompression* compression)
+{
+    const byte* ptr = (const byte*)data;
+    const byte* src = pfs_data(pfs) + ent->offset;
+    int64_t delta = (int64_t)len - (int64_t)ent->srcInflatedLen;
+    PfsBlockJobs ctx;
+    Array blocks;
+    Buffer* orig = NULL;
+    uint32_t pos = 0;
+    uint32_t head = 0;
+    uint32_t tail = 0;
+    uint32_t n;
+    int rc;
+    
+    pfs_block_jobs_init(&ctx, compression);
+    array_init(&blocks, PfsSrcBlock);
+    
+    rc = pfs_validate_entry(pfs, ent);
+    if (rc) goto abort;
+    
+    rc = pfs_source_blocks(pfs, ent, &blocks);
+    if (rc) goto abort;
+    
+    orig = pfs_inflate(pfs, src, ent->srcDeflatedLen, ent->srcInflatedLen);
+    
+    if (!orig)
+    {
+        rc = ERR_Compression;
+        goto abort;
+    }
+    
+    n = array_count(&blocks);
+    
+    /* Matches at the same offset are taken in order, followed by matches shifted by the change in
+       length; anything that would overlap what has already been laid out is skipped */
+    while (head < n || tail < n)
+    {
+        PfsSrcBlock* sb;
+        uint32_t offset;
+        PfsBlockJob job;
+        
+        if (head < n)
+        {
+            sb = array_get(&blocks, head++, PfsSrcBlock);
+            
+            if (!pfs_match_source_block(ptr, len, buf_data(orig), sb, 0, &offset))
+                continue;
+        }
+        else
+        {
+            sb = array_get(&blocks, tail++, PfsSrcBlock);
+            
+            if (delta == 0 || !pfs_match_source_block(ptr, len, buf_data(orig), sb, delta, &offset))
+                continue;
+        }
+        
+        if (offset < pos)
+            continue;
+        
+        rc = pfs_push_deflate_jobs(&ctx, ptr + pos, offset - pos);
+        if (rc) goto abort;
+        
+        job.src = src + sb->deflatedOffset;
+        job.dst = NULL;
+        job.deflatedLen = sb->deflatedLen;
+        job.inflatedLen = sb->inflatedLen;
+        job.reuse = true;
+        
+        if (!array_push_back(&ctx.jobs, &job))
+        {
+            rc = ERR_OutOfMemory;
+            goto abort;
+        }
+        
+        pos = offset + sb->inflatedLen;
+    }
+    
+    rc = pfs_push_deflate_jobs(&ctx, ptr + pos, len - pos);
+    
+    if (!rc)
+        rc = pfs_run_block_jobs(pfs, ent, &ctx);
+    
+abort:
+    if (orig) buf_destroy(orig);
+    array_deinit(&blocks, NULL);
+    array_deinit(&ctx.jobs, NULL);
+    return rc;
+}
+
+static int pfs_source_hash(Pfs* pfs, PfsEntry* ent, uint64_t* out)
+{
+    if (!ent->srcHashed)
+    {
+        Buffer* buf;
+        int rc = pfs_validate_entry(pfs, ent);
+        
+        if (rc) return rc;
+        
+        buf = pfs_inflate(pfs, pfs_data(pfs) + ent->offset, ent->srcDeflatedLen, ent->srcInflatedLen);
+        
+        if (!buf) return ERR_Compression;
+        
+        ent->srcHash = hash_data64(buf_data(buf), buf_length(buf));
+        ent->srcHashed = true;
+        buf_destroy(buf);
+    }
+    
+    *out = ent->srcHash;
+    return ERR_None;
+}
+
+int pfs_put(Pfs* pfs, const char* name, uint32_t namelen, const void* data, uint32_t datalen)
+{
+    return pfs_put_with(pfs, name, namelen, data, datalen, NULL);
+}
+
+int pfs_put_with(Pfs* pfs, const char* name, uint32_t namelen, const void* data, uint32_t datalen, const PfsCompression* compression)
+{
+    PfsEntry* ent;
+    uint64_t hash;
+    int rc;
+    
+    if (compression && !pfs_compression_valid(compression->level, compression->strategy))
+        return ERR_Invalid;
+    
+    ent = pfs_get_or_append_entry(pfs, name, namelen);
+    
+    if (!ent) return ERR_OutOfMemory;
+    
+    array_clear(&ent->blocks);
+    pfs_cache_drop(pfs, (uint32_t)(ent - array_data(&pfs->entries, PfsEntry)));
+    
+    /* Putting back exactly what the archive already had is common on re-runs; keep the original
+       compressed bytes rather than recompressing them */
+    if (ent->fromSource && datalen == ent->srcInflatedLen && pfs_source_hash(pfs, ent, &hash) == ERR_None &&
+        hash == hash_data64(data, datalen))
+    {
+        array_clear(&ent->replacement);
+        ent->replaced = false;
+        ent->inflatedLen = ent->srcInflatedLen;
+        ent->deflatedLen = ent->srcDeflatedLen;
+        return ERR_None;
+    }
+    
+    ent->customPolicy = (compression != NULL);
+    
+    if (!compression)
+        compression = &pfs->compression;
+    
+    array_clear(&ent->replacement);
+    ent->replaced = false;
+    
+    if (pfs->incremental && ent->fromSource && pfs_compress_incremental(pfs, ent, data, datalen, compression) == ERR_None)
+    {
+        ent->replaced = true;
+        return ERR_None;
+    }
+    
+    array_clear(&ent->replacement);
+    rc = pfs_compress(pfs, ent, data, datalen, compression);
+    ent->replaced = (rc == ERR_None);
+    return rc;
+}
+
+static int pfs_crc_cmp(const void* va, const void* vb)
 {
     PfsFileEntry* a = (PfsFileEntry*)va;
     PfsFileEntry* b = (PfsFileEntry*)vb;
@@ -405,16 +1480,17 @@ int pfs_save(Pfs* pfs)
 
 int pfs_save_as(Pfs* pfs, const char* path)
 {
-    FILE* fp;
     PfsHeader header;
     PfsFileEntry fent;
+    FileSegment seg;
     Array fileEntries;
-    Array dataBuf;
+    Array segments;
     Array nameBuf;
     PfsEntry nameBufCompressed;
     uint32_t p, n, i, c;
-    byte* pfsData = pfs_data(pfs);
-    int rc = ERR_None;
+    int rc = pfs_load_names(pfs);
+    
+    if (rc) return rc;
     
     memcpy(&header.signature, "PFS ", sizeof(header.signature));
     header.unknown = 131072; /* Always this */
@@ -422,14 +1498,26 @@ int pfs_save_as(Pfs* pfs, const char* path)
     p = sizeof(PfsHeader);
     c = array_count(&pfs->entries);
     
+    memset(&pfs->stats, 0, sizeof(PfsSaveStats));
+    pfs->stats.compression = pfs->compression;
+    pfs->stats.entriesWritten = c;
+    
     array_init(&fileEntries, PfsFileEntry);
-    array_init(&dataBuf, byte);
+    array_init(&segments, FileSegment);
     array_init(&nameBuf, byte);
     array_init(&nameBufCompressed.replacement, byte);
     
-    if (array_append(&nameBuf, &c, sizeof(uint32_t)))
+    if (array_append(&nameBuf, &c, sizeof(uint32_t)) || array_reserve(&segments, c + 4))
         goto mem_err;
     
+    /* Header; the offset to the CRC list is filled in once everything before it has been laid out */
+    seg.data = &header;
+    seg.srcOffset = 0;
+    seg.length = sizeof(header);
+    array_push_back(&segments, &seg);
+    
+    /* Every entry's new offset follows from the deflated lengths alone, so nothing has to be
+       copied here: unchanged entries are written straight from the source archive */
     for (i = 0; i < c; i++)
     {
         PfsEntry* ent = array_get(&pfs->entries, i, PfsEntry);
@@ -457,17 +1545,30 @@ int pfs_save_as(Pfs* pfs, const char* path)
         if (!array_push_back(&fileEntries, &fent))
             goto mem_err;
         
-        if (array_empty(&ent->replacement))
+        if (!ent->replaced)
         {
-            if (array_append(&dataBuf, pfsData + ent->offset, ent->deflatedLen))
-                goto mem_err;
+            rc = pfs_validate_entry(pfs, ent);
+            if (rc) goto abort;
+            
+            seg.data = NULL;
+            seg.srcOffset = ent->offset;
         }
         else
         {
-            if (array_append(&dataBuf, array_raw(&ent->replacement), ent->deflatedLen))
-                goto mem_err;
+            seg.data = array_raw(&ent->replacement);
+            seg.srcOffset = 0;
+            
+            pfs->stats.entriesReplaced++;
+            pfs->stats.blocksCompressed += ent->blocksCompressed;
+            pfs->stats.blocksReused += ent->blocksReused;
+            
+            if (ent->customPolicy)
+                pfs->stats.entriesCustomPolicy++;
         }
         
+        seg.length = ent->deflatedLen;
+        array_push_back(&segments, &seg);
+        
         p += ent->deflatedLen;
     }
     
@@ -479,60 +1580,39 @@ int pfs_save_as(Pfs* pfs, const char* path)
     if (!array_push_back(&fileEntries, &fent) || array_sort(&fileEntries, pfs_crc_cmp))
         goto mem_err;
     
-    rc = pfs_compress(&nameBufCompressed, array_raw(&nameBuf), array_count(&nameBuf));
+    rc = pfs_compress(pfs, &nameBufCompressed, array_raw(&nameBuf), array_count(&nameBuf), &pfs->compression);
     
     if (rc) goto abort;
     
-    p += array_count(&nameBufCompressed.replacement);
-    
-    header.offset = p;
-    fp = fopen(path, "wb+");
-    
-    if (!fp)
-    {
-        rc = ERR_CouldNotOpen;
-        goto abort;
-    }
-    
-    /* Header */
-    if (fwrite(&header, sizeof(byte), sizeof(header), fp) != sizeof(header))
-        goto file_err;
+    pfs->stats.blocksCompressed += nameBufCompressed.blocksCompressed;
     
-    /* Compressed entries */
-    n = array_count(&dataBuf);
-    if (fwrite(array_raw(&dataBuf), sizeof(byte), n, fp) != n)
-        goto file_err;
+    seg.data = array_raw(&nameBufCompressed.replacement);
+    seg.srcOffset = 0;
+    seg.length = array_count(&nameBufCompressed.replacement);
+    array_push_back(&segments, &seg);
     
-    /* Compressed names entry */
-    n = array_count(&nameBufCompressed.replacement);
-    if (fwrite(array_raw(&nameBufCompressed.replacement), sizeof(byte), n, fp) != n)
-        goto file_err;
+    p += seg.length;
+    header.offset = p;
     
     /* Offset and CRC list in order of CRC */
     n = array_count(&fileEntries);
-    if (fwrite(&n, sizeof(byte), sizeof(uint32_t), fp) != sizeof(uint32_t))
-        goto file_err;
     
-    for (i = 0; i < n; i++)
-    {
-        PfsFileEntry* ent = array_get(&fileEntries, i, PfsFileEntry);
-        
-        if (!ent)
-        {
-            rc = ERR_OutOfBounds;
-            break;
-        }
-        
-        if (fwrite(ent, sizeof(byte), sizeof(PfsFileEntry), fp) != sizeof(PfsFileEntry))
-            goto file_err;
-    }
+    seg.data = &n;
+    seg.length = sizeof(uint32_t);
+    array_push_back(&segments, &seg);
+    
+    seg.data = array_raw(&fileEntries);
+    seg.length = n * sizeof(PfsFileEntry);
+    array_push_back(&segments, &seg);
+    
+    rc = file_write_segments(path, array_data(&segments, FileSegment), array_count(&segments), &pfs->raw);
     
-close_file:
-    fclose(fp);
+    if (!rc)
+        pfs->stats.bytesWritten = p + sizeof(uint32_t) + n * sizeof(PfsFileEntry);
     
 abort:
     array_deinit(&fileEntries, NULL);
-    array_deinit(&dataBuf, NULL);
+    array_deinit(&segments, NULL);
     array_deinit(&nameBuf, NULL);
     array_deinit(&nameBufCompressed.replacement, NULL);
     
@@ -541,14 +1621,158 @@ abort:
 mem_err:
     rc = ERR_OutOfMemory;
     goto abort;
-    
-file_err:
-    rc = ERR_FileOperation;
-    goto close_file;
 }
 
 Buffer* pfs_get_name(Pfs* pfs, uint32_t index)
 {
-    PfsEntry* ent = array_get(&pfs->entries, index, PfsEntry);
+    PfsEntry* ent;
+    
+    if (pfs_load_names(pfs))
+        return NULL;
+    
+    ent = array_get(&pfs->entries, index, PfsEntry);
     return (ent != NULL) ? ent->name : NULL;
 }
+
+/* A PfsView is opened once and never written to, so everything a read needs is settled up front:
+   every block chain is walked and the name table is loaded. What's left to share between threads is
+   the pool of codec contexts, and block indices for range reads, which are built under the lock */
+   
+int pfs_view_open(PfsView* view, const char* path, int flags)
+{
+    int rc;
+    
+    memset(view, 0, sizeof(PfsView));
+    array_init(&view->idle, CodecCtx*);
+    
+    rc = mutex_init(&view->lock);
+    if (rc) return rc;
+    
+    rc = pfs_open_flags(&view->pfs, path, flags & ~PFS_OPEN_Fast);
+    
+    /* Concurrency comes from the callers; a single read stays on the thread that asked for it. Set
+       before the names are loaded, so that a big name table doesn't start a pool nothing else uses */
+    pfs_set_threads(&view->pfs, 1);
+    
+    if (!rc)
+        rc = pfs_load_names(&view->pfs);
+    
+    return rc;
+}
+
+void pfs_view_close(PfsView* view)
+{
+    array_deinit(&view->idle, pfs_destroy_codec);
+    mutex_deinit(&view->lock);
+    pfs_close(&view->pfs);
+}
+
+static PfsEntry* pfs_view_entry(PfsView* view, const char* name, uint32_t len)
+{
+    int index = pfs_index_by_name(&view->pfs, name, len);
+    return (index >= 0) ? array_get(&view->pfs.entries, (uint32_t)index, PfsEntry) : NULL;
+}
+
+static CodecCtx* pfs_view_acquire(PfsView* view)
+{
+    CodecCtx* codec = NULL;
+    
+    mutex_lock(&view->lock);
+    
+    if (!array_empty(&view->idle))
+    {
+        CodecCtx** back = array_back(&view->idle, CodecCtx*);
+        codec = *back;
+        array_pop_back(&view->idle);
+    }
+    
+    mutex_unlock(&view->lock);
+    
+    return (codec) ? codec : codec_ctx_create();
+}
+
+static void pfs_view_release(PfsView* view, CodecCtx* codec)
+{
+    if (!codec) return;
+    
+    mutex_lock(&view->lock);
+    
+    if (!array_push_back(&view->idle, &codec))
+        codec_ctx_destroy(codec);
+    
+    mutex_unlock(&view->lock);
+}
+
+Buffer* pfs_view_get(PfsView* view, const char* name, uint32_t len)
+{
+    PfsEntry* ent = pfs_view_entry(view, name, len);
+    CodecCtx* codec;
+    Buffer* buf;
+    
+    if (!ent) return NULL;
+    
+    buf = buf_create(NULL, ent->inflatedLen);
+    
+    if (!buf) return NULL;
+    
+    codec = pfs_view_acquire(view);
+    
+    if (!codec || pfs_inflate_serial(codec, pfs_entry_data(&view->pfs, ent), ent->deflatedLen, buf_writable(buf), ent->inflatedLen))
+    {
+        buf_destroy(buf);
+        buf = NULL;
+    }
+    
+    pfs_view_release(view, codec);
+    return buf;
+}
+
+int pfs_view_get_into(PfsView* view, const char* name, uint32_t len, void* dst, uint32_t dstlen, uint32_t* outlen)
+{
+    PfsEntry* ent = pfs_view_entry(view, name, len);
+    CodecCtx* codec;
+    int rc;
+    
+    if (!ent) return ERR_Invalid;
+    
+    *outlen = ent->inflatedLen;
+    
+    if (dstlen < ent->inflatedLen)
+        return ERR_OutOfSpace;
+    
+    codec = pfs_view_acquire(view);
+    
+    if (!codec) return ERR_OutOfMemory;
+    
+    rc = pfs_inflate_serial(codec, pfs_entry_data(&view->pfs, ent), ent->deflatedLen, (byte*)dst, ent->inflatedLen);
+    
+    pfs_view_release(view, codec);
+    return rc;
+}
+
+int pfs_view_read_range(PfsView* view, const char* name, uint32_t offset, uint32_t len, void* dst)
+{
+    PfsEntry* ent = pfs_view_entry(view, name, 0);
+    CodecCtx* codec;
+    int rc;
+    
+    if (!ent) return ERR_Invalid;
+    
+    if (offset > ent->inflatedLen || len > ent->inflatedLen - offset)
+        return ERR_OutOfBounds;
+    
+    mutex_lock(&view->lock);
+    rc = pfs_entry_block_index(&view->pfs, ent);
+    mutex_unlock(&view->lock);
+    
+    if (rc) return rc;
+    
+    codec = pfs_view_acquire(view);
+    
+    if (!codec) return ERR_OutOfMemory;
+    
+    rc = pfs_read_blocks(codec, ent, pfs_entry_data(&view->pfs, ent), offset, len, (byte*)dst);
+    
+    pfs_view_release(view, codec);
+    return rc;
+}
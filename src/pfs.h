@@ -6,17 +6,73 @@
 #include "structs.h"
 #include "util_container.h"
 #include "util_alloc.h"
+#include "util_file.h"
+#include "util_thread.h"
+#include "codec.h"
 #include "crc.h"
-#include <zlib.h>
+#include "hash.h"
+
+#define PFS_BLOCK_SIZE 8192 /* The most a block inflates to, in the client's archives and ours */
+
+enum PfsOpenFlag {
+    PFS_OPEN_Default    = 0,
+    PFS_OPEN_NoMap      = 1 << 0,   /* Read the whole archive into memory instead of mapping it */
+    PFS_OPEN_Fast       = 1 << 1    /* Don't walk every entry's blocks up front; each entry is checked when first used */
+};
+
+enum PfsCompressPreset {
+    PFS_COMPRESS_Max,   /* Level 9, what the client's own archives use; for release */
+    PFS_COMPRESS_Fast   /* Level 1, for iterating during development */
+};
 
 int pfs_open(Pfs* pfs, const char* path);
+int pfs_open_flags(Pfs* pfs, const char* path, int flags);
 void pfs_close(Pfs* pfs);
+void pfs_set_threads(Pfs* pfs, uint32_t count);
+void pfs_set_incremental(Pfs* pfs, bool enable);
+int pfs_set_compression(Pfs* pfs, int level, int strategy);
+void pfs_set_compression_preset(Pfs* pfs, int preset);
+void pfs_set_cache(Pfs* pfs, uint32_t maxBytes); /* Keep up to this many bytes of inflated entries around; 0 (the default) for none */
 int pfs_save(Pfs* pfs);
 int pfs_save_as(Pfs* pfs, const char* path);
 
+/* Reads through the cache, but never adds to it; only pfs_get_shared does that */
 Buffer* pfs_get(Pfs* pfs, const char* name, uint32_t len);
+/* Like pfs_get, but the Buffer may be shared with the cache; free it with buf_release */
+Buffer* pfs_get_shared(Pfs* pfs, const char* name, uint32_t len);
+/* Copies [offset, offset + len) of an entry's inflated contents to dst, inflating only the blocks that overlap it */
+int pfs_read_range(Pfs* pfs, const char* name, uint32_t offset, uint32_t len, void* dst);
+/* Identifies an entry's current contents by hashing its compressed bytes, without inflating anything */
+int pfs_fingerprint(Pfs* pfs, const char* name, uint32_t len, PfsFingerprint* out);
+/* Inflates a whole entry into dst; outlen gets the entry's length even if it didn't fit (ERR_OutOfSpace) */
+int pfs_get_into(Pfs* pfs, const char* name, uint32_t len, void* dst, uint32_t dstlen, uint32_t* outlen);
+
+/* Reads an entry one block at a time into the caller's buffer, PFS_BLOCK_SIZE bytes of which is
+   enough for any archive we know of. outlen is 0 once everything has been read; a bigger block gets
+   ERR_OutOfSpace with outlen set to the size it needs. The entry mustn't be put while it's open */
+int pfs_reader_open(PfsReader* rd, Pfs* pfs, const char* name, uint32_t len);
+int pfs_reader_next(PfsReader* rd, void* dst, uint32_t dstlen, uint32_t* outlen);
+void pfs_reader_close(PfsReader* rd);
+#define pfs_reader_length(rd) ((rd)->inflatedLen)
+
+/* A Pfs is the read-write builder, and belongs to one thread at a time. A PfsView is a read-only
+   archive that any number of threads can get from at once; it walks every block chain and loads the
+   name table when opened (PFS_OPEN_Fast is ignored). Always pfs_view_close it, even if opening failed */
+int pfs_view_open(PfsView* view, const char* path, int flags);
+void pfs_view_close(PfsView* view);
+Buffer* pfs_view_get(PfsView* view, const char* name, uint32_t len);
+int pfs_view_get_into(PfsView* view, const char* name, uint32_t len, void* dst, uint32_t dstlen, uint32_t* outlen);
+int pfs_view_read_range(PfsView* view, const char* name, uint32_t offset, uint32_t len, void* dst);
+#define pfs_view_get_name(view, index) pfs_get_name(&(view)->pfs, (index))
 int pfs_put(Pfs* pfs, const char* name, uint32_t namelen, const void* data, uint32_t datalen);
+int pfs_put_with(Pfs* pfs, const char* name, uint32_t namelen, const void* data, uint32_t datalen, const PfsCompression* compression);
 
 Buffer* pfs_get_name(Pfs* pfs, uint32_t index);
 
+#define pfs_save_stats(pfs) ((const PfsSaveStats*)&(pfs)->stats)
+#define pfs_cache_stats(pfs) ((const PfsCacheStats*)&(pfs)->cacheStats)
+#define pfs_raw_data(pfs) fmap_data(&(pfs)->raw)
+#define pfs_raw_length(pfs) fmap_length(&(pfs)->raw)
+#define pfs_raw_file(pfs) (&(pfs)->raw)
+
 #endif/*PFS_H*/
@@ -6,20 +6,103 @@
 #include "bit.h"
 #include "structs_container.h"
 #include "structs_wld_frag.h"
+#include "util_thread.h"
+
+typedef struct FileMap {
+    byte*       data;
+    uint32_t    length;
+    Buffer*     heap;   /* Only set if the file had to be read into memory rather than mapped */
+    int         fd;
+} FileMap;
+
+typedef struct PfsCompression {
+    int         level;      /* 0 (stored) to 9 (smallest) */
+    int         strategy;   /* CodecStrategy; the same values as zlib's */
+} PfsCompression;
+
+typedef struct PfsSaveStats {
+    PfsCompression  compression;        /* Archive-wide policy, also used for the names entry */
+    uint32_t        entriesWritten;
+    uint32_t        entriesReplaced;
+    uint32_t        entriesCustomPolicy; /* Replaced entries that were put with their own policy */
+    uint32_t        blocksCompressed;
+    uint32_t        blocksReused;
+    uint32_t        bytesWritten;
+} PfsSaveStats;
+
+typedef struct PfsCacheStats {
+    uint32_t    hits;
+    uint32_t    misses;
+    uint32_t    evictions;
+    uint32_t    entries;    /* Currently held */
+    uint32_t    bytes;
+} PfsCacheStats;
+
+typedef struct PfsFingerprint {
+    uint64_t    hash;       /* Of the compressed bytes */
+    uint32_t    crc;        /* Of the name */
+    uint32_t    inflatedLen;
+    uint32_t    deflatedLen;
+} PfsFingerprint;
 
 typedef struct Pfs {
-    Array   entries;
-    HashTbl byName;
-    Buffer* raw;
-    Buffer* path;
+    Array       entries;
+    HashTbl     byName;         /* Only filled in once the name table has been loaded */
+    Array       byCrc;          /* Answers lookups by name until then */
+    uint32_t    namesOffset;
+    uint32_t    namesDeflatedLen;
+    uint32_t    namesInflatedLen;
+    bool        namesLoaded;
+    FileMap     raw;
+    Buffer*     path;
+    uint32_t    threadCount;
+    ThreadPool* pool;           /* threadCount - 1 threads, started by the first job that wants them */
+    Array       codecs;         /* CodecCtx*, one for each worker that has needed one so far */
+    bool        incremental;    /* Only recompress the blocks of an entry that pfs_put actually changed */
+    PfsCompression  compression;
+    PfsSaveStats    stats;
+    uint32_t    cacheLimit;     /* Bytes of inflated entries kept around; 0 for no cache */
+    uint32_t    lruHead;        /* Entry indices; least recently used first */
+    uint32_t    lruTail;
+    PfsCacheStats   cacheStats;
 } Pfs;
 
+typedef struct PfsReader {
+    Pfs*        pfs;
+    const byte* src;        /* The entry's compressed bytes; only good until the entry is next put */
+    uint32_t    deflatedLen;
+    uint32_t    inflatedLen;
+    uint32_t    pos;        /* Of the next block header in src */
+    uint32_t    read;       /* Inflated bytes handed out so far */
+} PfsReader;
+
+typedef struct PfsView {
+    Pfs         pfs;        /* Never modified once pfs_view_open returns, apart from block indices (under lock) */
+    Array       idle;       /* CodecCtx* that no thread is using right now */
+    Mutex       lock;
+} PfsView;
+
+typedef struct WldName {
+    const char* name;
+    uint32_t    frag;
+} WldName;
+
 typedef struct Wld {
-    Array   fragsByIndex;
-    HashTbl fragsByNameRef;
+    uint32_t    fragCount;
+    uint32_t*   fragOffsets;    /* Of each fragment in data, indexed by ref; [0] is unused */
+    int*        fragNameRefs;   /* As they were in the file */
+    uint8_t*    fragTypes;      /* WLD_FRAG_TYPE_Large for any that don't fit */
+    byte*       fragBase;       /* The start of data */
+    HashTbl fragsByNameRef;     /* Index into the above */
+    uint32_t*   typeStarts;     /* Per-type index: typeFrags[typeStarts[t] .. typeStarts[t + 1]] are the fragments of type t */
+    uint32_t*   typeFrags;
+    Array       names;          /* WldName for every named fragment, by name and then index */
+    bool        namesIndexed;
     char*   strings;
     int     stringsLength;
     Buffer* data;
+    const byte* encoded;    /* WLD_OPEN_LazyStrings: the table as it is in data, which is left alone */
+    byte*   decodedBits;    /* One bit for each byte of strings that has been decoded so far */
 } Wld;
 
 typedef struct WldHeader {
@@ -50,4 +133,35 @@ typedef struct VirtualWld {
     uint32_t    fragCount;
 } VirtualWld;
 
+typedef struct WldRule {
+    const char* prefix;     /* Of the fragment's name; "" matches every named fragment */
+    uint32_t    type;       /* Fragment type, or WLD_RULE_AnyType */
+    int         action;     /* WldRuleAction */
+} WldRule;
+
+typedef struct WldRuleNode {
+    uint32_t    child;      /* First child node; 0 (the root) for none */
+    uint32_t    sibling;
+    uint32_t    rules;      /* First rule whose prefix ends here, chained through WldRuleEntry.next */
+    char        c;
+} WldRuleNode;
+
+typedef struct WldRuleEntry {
+    uint32_t    type;
+    int         action;
+    uint32_t    next;
+} WldRuleEntry;
+
+typedef struct WldRuleSet {
+    Array       nodes;      /* WldRuleNode, the prefix trie; node 0 is the root */
+    Array       rules;      /* WldRuleEntry, in the order they were added */
+    uint64_t    fingerprint; /* Of every rule added so far, in order */
+} WldRuleSet;
+
+typedef struct WldRuleStats {
+    uint32_t    moved;
+    uint32_t    duplicated;
+    uint32_t    dropped;
+} WldRuleStats;
+
 #endif/*STRUCTS_H*/
@@ -1,5 +1,6 @@
 
 #include "util_buffer.h"
+#include "util_thread.h"
 
 Buffer* buf_create(const void* data, uint32_t len)
 {
@@ -19,6 +20,45 @@ Buffer* buf_create(const void* data, uint32_t len)
     return (Buffer*)ptr;
 }
 
+Buffer* buf_create_shared(const void* data, uint32_t len)
+{
+    uint32_t dlen   = len + sizeof(uint32_t) * 2 + 1;
+    byte* ptr       = alloc_bytes(dlen);
+    uint32_t* pref  = (uint32_t*)ptr;
+    uint32_t* plen  = pref + 1;
+    
+    if (!ptr) return NULL;
+    
+    *pref = 1;
+    *plen = len;
+    
+    if (data && len)
+        memcpy(ptr + sizeof(uint32_t) * 2, data, len);
+    
+    ptr[dlen - 1] = 0;
+    
+    return (Buffer*)plen;
+}
+
+Buffer* buf_retain(Buffer* buf)
+{
+    uint32_t* pref = ((uint32_t*)buf) - 1;
+    atomic_add_u32(pref, 1);
+    return buf;
+}
+
+void buf_release(Buffer* buf)
+{
+    uint32_t* pref;
+    
+    if (!buf) return;
+    
+    pref = ((uint32_t*)buf) - 1;
+    
+    if (atomic_add_u32(pref, (uint32_t)-1) == 1)
+        free(pref);
+}
+
 Buffer* buf_from_file(const char* path)
 {
     FILE* fp = fopen(path, "rb");
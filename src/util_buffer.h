@@ -11,6 +11,12 @@ Buffer* buf_create(const void* data, uint32_t len);
 Buffer* buf_from_file(const char* path);
 Buffer* buf_from_file_ptr(FILE* fp);
 
+/* Reference-counted Buffers, which live until the last reference is released. The count sits just
+   in front of the Buffer, so these must only ever be freed with buf_release, never buf_destroy */
+Buffer* buf_create_shared(const void* data, uint32_t len);
+Buffer* buf_retain(Buffer* buf);
+void buf_release(Buffer* buf);
+
 uint32_t buf_length(Buffer* buf);
 const byte* buf_data(Buffer* buf);
 byte* buf_writable(Buffer* buf);
@@ -0,0 +1,473 @@
+
+#ifdef __linux__
+# define _GNU_SOURCE /* copy_file_range */
+#endif
+
+#include "util_file.h"
+#include "util_array.h"
+
+#ifdef PLATFORM_UNIX
+# include <fcntl.h>
+# include <glob.h>
+# include <sys/mman.h>
+# include <sys/uio.h>
+#endif
+
+#ifdef __linux__
+# include <sys/ioctl.h>
+# ifndef FICLONE
+#  define FICLONE _IOW(0x94, 9, int) /* From linux/fs.h, which doesn't mix well with the libc headers */
+# endif
+#endif
+
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+# define HAVE_COPY_FILE_RANGE
+#endif
+
+#define FILE_WRITE_MAX_VECS 64
+
+static void fmap_init(FileMap* fmap)
+{
+    fmap->data      = NULL;
+    fmap->length    = 0;
+    fmap->heap      = NULL;
+    fmap->fd        = -1;
+}
+
+int fmap_read(FileMap* fmap, const char* path)
+{
+    Buffer* buf;
+    
+    fmap_init(fmap);
+    
+    buf = buf_from_file(path);
+    
+    if (!buf) return ERR_CouldNotOpen;
+    
+    fmap->data      = buf_writable(buf);
+    fmap->length    = buf_length(buf);
+    fmap->heap      = buf;
+    
+    return ERR_None;
+}
+
+#ifdef PLATFORM_UNIX
+int fmap_open(FileMap* fmap, const char* path)
+{
+    struct stat st;
+    void* ptr;
+    int fd = open(path, O_RDONLY);
+    
+    fmap_init(fmap);
+    
+    if (fd == -1) return ERR_CouldNotOpen;
+    
+    if (fstat(fd, &st) || st.st_size <= 0 || (uint64_t)st.st_size > UINT32_MAX)
+        goto fallback;
+    
+    ptr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    
+    if (ptr == MAP_FAILED)
+        goto fallback;
+    
+    fmap->data      = (byte*)ptr;
+    fmap->length    = (uint32_t)st.st_size;
+    fmap->fd        = fd;
+    
+    return ERR_None;
+    
+fallback:
+    close(fd);
+    return fmap_read(fmap, path);
+}
+#else
+int fmap_open(FileMap* fmap, const char* path)
+{
+    /* Windows won't let us overwrite a file while a view of it is mapped, which is exactly
+       what a save back to the same archive does, so always take the in-memory path here */
+    return fmap_read(fmap, path);
+}
+#endif
+
+void fmap_close(FileMap* fmap)
+{
+    if (fmap->heap)
+    {
+        buf_destroy(fmap->heap);
+    }
+#ifdef PLATFORM_UNIX
+    else if (fmap->data)
+    {
+        munmap(fmap->data, fmap->length);
+    }
+    
+    if (fmap->fd != -1)
+        close(fmap->fd);
+#endif
+    
+    fmap_init(fmap);
+}
+
+static Buffer* file_temp_path(const char* path)
+{
+    static const char suffix[] = ".tmp";
+    uint32_t len = strlen(path);
+    Buffer* buf = buf_create(NULL, len + sizeof(suffix) - 1);
+    
+    if (!buf) return NULL;
+    
+    memcpy(buf_writable(buf), path, len);
+    memcpy(buf_writable(buf) + len, suffix, sizeof(suffix) - 1);
+    return buf;
+}
+
+#ifdef PLATFORM_UNIX
+static int file_write_all(int fd, struct iovec* vecs, int count)
+{
+    while (count > 0)
+    {
+        ssize_t wrote = writev(fd, vecs, count);
+        
+        if (wrote < 0)
+        {
+            if (errno == EINTR) continue;
+            return ERR_FileOperation;
+        }
+        
+        /* Skip past whatever was fully written and trim a partially written vec */
+        while (count > 0 && (size_t)wrote >= vecs->iov_len)
+        {
+            wrote -= vecs->iov_len;
+            vecs++;
+            count--;
+        }
+        
+        if (count > 0)
+        {
+            vecs->iov_base = (byte*)vecs->iov_base + wrote;
+            vecs->iov_len -= wrote;
+        }
+    }
+    
+    return ERR_None;
+}
+
+static int file_copy_range(int fdIn, uint32_t offset, int fdOut, uint32_t len, uint32_t* copied)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+    loff_t off = offset;
+    
+    while (*copied < len)
+    {
+        ssize_t n = copy_file_range(fdIn, &off, fdOut, NULL, len - *copied, 0);
+        
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR) continue;
+            return ERR_FileOperation;
+        }
+        
+        *copied += (uint32_t)n;
+    }
+    
+    return ERR_None;
+#else
+    (void)fdIn; (void)offset; (void)fdOut; (void)len; (void)copied;
+    return ERR_FileOperation;
+#endif
+}
+
+/* Shares the source's blocks with the destination instead of copying them, on filesystems that can (btrfs, XFS) */
+static int file_clone(int fdIn, int fdOut)
+{
+#ifdef __linux__
+    return ioctl(fdOut, FICLONE, fdIn) ? ERR_FileOperation : ERR_None;
+#else
+    (void)fdIn; (void)fdOut;
+    return ERR_FileOperation;
+#endif
+}
+
+static int file_write_fd(int fd, const FileSegment* segs, uint32_t count, FileMap* src)
+{
+    struct iovec vecs[FILE_WRITE_MAX_VECS];
+    int useCopy = (src && src->fd != -1);
+    int n = 0;
+    uint32_t i = 0;
+    int rc;
+    
+    while (i < count)
+    {
+        const FileSegment* seg = &segs[i++];
+        uint32_t offset = seg->srcOffset;
+        uint32_t len = seg->length;
+        
+        if (len == 0)
+            continue;
+        
+        if (!seg->data)
+        {
+            /* Unchanged entries tend to sit back to back in the source, so treat each run as one */
+            while (i < count && !segs[i].data && segs[i].srcOffset == offset + len)
+            {
+                len += segs[i++].length;
+            }
+            
+            if (!src || offset > src->length || len > src->length - offset)
+                return ERR_OutOfBounds;
+            
+            if (useCopy)
+            {
+                uint32_t copied = 0;
+                
+                if (n > 0)
+                {
+                    rc = file_write_all(fd, vecs, n);
+                    if (rc) return rc;
+                    n = 0;
+                }
+                
+                if (file_copy_range(src->fd, offset, fd, len, &copied) == ERR_None)
+                    continue;
+                
+                /* Not supported for this pair of files; write from the mapping from now on */
+                useCopy = false;
+                offset += copied;
+                len -= copied;
+            }
+        }
+        
+        vecs[n].iov_base = (void*)(seg->data ? (const byte*)seg->data : src->data + offset);
+        vecs[n].iov_len = len;
+        n++;
+        
+        if (n == FILE_WRITE_MAX_VECS)
+        {
+            rc = file_write_all(fd, vecs, n);
+            if (rc) return rc;
+            n = 0;
+        }
+    }
+    
+    return (n > 0) ? file_write_all(fd, vecs, n) : ERR_None;
+}
+
+int file_write_segments(const char* path, const FileSegment* segs, uint32_t count, FileMap* src)
+{
+    Buffer* tmp = file_temp_path(path);
+    struct stat st;
+    int fd;
+    int rc;
+    
+    if (!tmp) return ERR_OutOfMemory;
+    
+    fd = open(buf_str(tmp), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    
+    if (fd == -1)
+    {
+        buf_destroy(tmp);
+        return ERR_CouldNotOpen;
+    }
+    
+    /* Keep the permissions of the file we're replacing */
+    if (stat(path, &st) == 0)
+        fchmod(fd, st.st_mode & 07777);
+    
+    /* A straight copy of the whole source can be a reflink */
+    if (count == 1 && !segs->data && segs->srcOffset == 0 && src && src->fd != -1 && segs->length == src->length &&
+        file_clone(src->fd, fd) == ERR_None)
+        rc = ERR_None;
+    else
+        rc = file_write_fd(fd, segs, count, src);
+    
+    if (close(fd) && !rc)
+        rc = ERR_FileOperation;
+    
+    if (!rc && rename(buf_str(tmp), path))
+        rc = ERR_FileOperation;
+    
+    if (rc)
+        unlink(buf_str(tmp));
+    
+    buf_destroy(tmp);
+    return rc;
+}
+#else
+int file_write_segments(const char* path, const FileSegment* segs, uint32_t count, FileMap* src)
+{
+    Buffer* tmp = file_temp_path(path);
+    FILE* fp;
+    uint32_t i;
+    int rc = ERR_None;
+    
+    if (!tmp) return ERR_OutOfMemory;
+    
+    fp = fopen(buf_str(tmp), "wb");
+    
+    if (!fp)
+    {
+        buf_destroy(tmp);
+        return ERR_CouldNotOpen;
+    }
+    
+    for (i = 0; i < count; i++)
+    {
+        const FileSegment* seg = &segs[i];
+        const byte* data = (const byte*)seg->data;
+        
+        if (!data)
+        {
+            if (!src || seg->srcOffset > src->length || seg->length > src->length - seg->srcOffset)
+            {
+                rc = ERR_OutOfBounds;
+                break;
+            }
+            
+            data = src->data + seg->srcOffset;
+        }
+        
+        if (fwrite(data, sizeof(byte), seg->length, fp) != seg->length)
+        {
+            rc = ERR_FileOperation;
+            break;
+        }
+    }
+    
+    if (fclose(fp) && !rc)
+        rc = ERR_FileOperation;
+    
+    if (!rc && !MoveFileExA(buf_str(tmp), path, MOVEFILE_REPLACE_EXISTING))
+        rc = ERR_FileOperation;
+    
+    if (rc)
+        DeleteFileA(buf_str(tmp));
+    
+    buf_destroy(tmp);
+    return rc;
+}
+#endif
+
+#undef FILE_WRITE_MAX_VECS
+
+int file_copy(const char* path, FileMap* src)
+{
+    FileSegment seg;
+    
+    seg.data        = NULL;
+    seg.srcOffset   = 0;
+    seg.length      = src->length;
+    
+    return file_write_segments(path, &seg, 1, src);
+}
+
+#ifdef PLATFORM_UNIX
+int file_is_dir(const char* path)
+{
+    struct stat st;
+    return (stat(path, &st) == 0 && S_ISDIR(st.st_mode));
+}
+
+int file_id(const char* path, FileId* out)
+{
+    struct stat st;
+    
+    if (stat(path, &st))
+        return ERR_CouldNotOpen;
+    
+    out->volume = (uint64_t)st.st_dev;
+    out->index  = (uint64_t)st.st_ino;
+    return ERR_None;
+}
+
+int file_glob(const char* pattern, Array* out)
+{
+    glob_t g;
+    size_t i;
+    int rc = glob(pattern, 0, NULL, &g);
+    
+    if (rc == GLOB_NOMATCH) return ERR_None;
+    if (rc) return (rc == GLOB_NOSPACE) ? ERR_OutOfMemory : ERR_CouldNotOpen;
+    
+    for (i = 0; i < g.gl_pathc; i++)
+    {
+        Buffer* path = buf_create(g.gl_pathv[i], strlen(g.gl_pathv[i]));
+        
+        if (!path || !array_push_back(out, &path))
+        {
+            if (path) buf_destroy(path);
+            rc = ERR_OutOfMemory;
+            break;
+        }
+    }
+    
+    globfree(&g);
+    return rc;
+}
+#else
+int file_is_dir(const char* path)
+{
+    DWORD attr = GetFileAttributesA(path);
+    return (attr != INVALID_FILE_ATTRIBUTES && (attr & FILE_ATTRIBUTE_DIRECTORY));
+}
+
+int file_id(const char* path, FileId* out)
+{
+    BY_HANDLE_FILE_INFORMATION info;
+    HANDLE file = CreateFileA(path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+        FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    BOOL ok;
+    
+    if (file == INVALID_HANDLE_VALUE)
+        return ERR_CouldNotOpen;
+    
+    ok = GetFileInformationByHandle(file, &info);
+    CloseHandle(file);
+    
+    if (!ok) return ERR_FileOperation;
+    
+    out->volume = info.dwVolumeSerialNumber;
+    out->index  = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+    return ERR_None;
+}
+
+int file_glob(const char* pattern, Array* out)
+{
+    WIN32_FIND_DATAA fd;
+    HANDLE find = FindFirstFileA(pattern, &fd);
+    const char* slash = strrchr(pattern, '\\');
+    const char* fwd = strrchr(pattern, '/');
+    uint32_t dirlen;
+    int rc = ERR_None;
+    
+    if (find == INVALID_HANDLE_VALUE) return ERR_None;
+    
+    /* FindFirstFile only gives back the file name; keep the directory the pattern was in */
+    if (fwd > slash) slash = fwd;
+    dirlen = (slash) ? (uint32_t)(slash - pattern + 1) : 0;
+    
+    do
+    {
+        uint32_t namelen = strlen(fd.cFileName);
+        Buffer* path;
+        
+        if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            continue;
+        
+        path = buf_create(NULL, dirlen + namelen);
+        
+        if (!path || !array_push_back(out, &path))
+        {
+            if (path) buf_destroy(path);
+            rc = ERR_OutOfMemory;
+            break;
+        }
+        
+        memcpy(buf_writable(path), pattern, dirlen);
+        memcpy(buf_writable(path) + dirlen, fd.cFileName, namelen);
+    }
+    while (FindNextFileA(find, &fd));
+    
+    FindClose(find);
+    return rc;
+}
+#endif
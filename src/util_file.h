@@ -0,0 +1,42 @@
+
+#ifndef UTIL_FILE_H
+#define UTIL_FILE_H
+
+#include "define.h"
+#include "structs.h"
+#include "util_buffer.h"
+
+typedef struct FileSegment {
+    const void* data;       /* If NULL, the bytes are taken from the source file at srcOffset */
+    uint32_t    srcOffset;
+    uint32_t    length;
+} FileSegment;
+
+typedef struct FileId {
+    uint64_t    volume;
+    uint64_t    index;
+} FileId;
+
+int fmap_open(FileMap* fmap, const char* path);
+int fmap_read(FileMap* fmap, const char* path);
+void fmap_close(FileMap* fmap);
+
+/* Writes the segments in order to a temporary file next to path, then renames it over path.
+   src may be mapped from path itself; it stays valid until it is closed */
+int file_write_segments(const char* path, const FileSegment* segs, uint32_t count, FileMap* src);
+/* Writes all of src to path the same way: as a reflink where the filesystem supports it, otherwise
+   with copy_file_range, otherwise from the mapping */
+int file_copy(const char* path, FileMap* src);
+
+int file_is_dir(const char* path);
+/* Which file path names, however it's spelled: two paths get the same id only if they're the same file */
+int file_id(const char* path, FileId* out);
+#define file_id_equal(a, b) ((a)->volume == (b)->volume && (a)->index == (b)->index)
+/* Appends a Buffer* for every file matching pattern, which may use * and ? in its last component */
+int file_glob(const char* pattern, Array* out);
+
+#define fmap_data(fmap) ((const byte*)(fmap)->data)
+#define fmap_length(fmap) ((fmap)->length)
+#define fmap_is_mapped(fmap) ((fmap)->data != NULL && (fmap)->heap == NULL)
+
+#endif/*UTIL_FILE_H*/
@@ -0,0 +1,348 @@
+
+#include "util_thread.h"
+#include "util_alloc.h"
+
+#define PARALLEL_MAX_WORKERS 64
+
+typedef struct ParallelFor {
+    volatile uint32_t   next;
+    uint32_t            count;
+    ParallelCallback    func;
+    void*               userdata;
+} ParallelFor;
+
+typedef struct ParallelWorker {
+    ParallelFor*    job;
+    uint32_t        index;
+} ParallelWorker;
+
+struct ThreadPool {
+    Thread              threads[PARALLEL_MAX_WORKERS];
+    uint32_t            count;      /* Threads actually started */
+    Semaphore           start;      /* Posted once for each thread a job wants */
+    Semaphore           done;       /* Posted by each of those threads once the job has run out */
+    ParallelFor         job;
+    volatile uint32_t   nextWorker; /* Handed out to the threads as they pick up a job */
+    volatile bool       stop;
+};
+
+#ifdef PLATFORM_WINDOWS
+static DWORD WINAPI thread_proc(LPVOID ptr)
+{
+    Thread* thread = (Thread*)ptr;
+    thread->func(thread->userdata);
+    return 0;
+}
+
+int thread_start(Thread* thread, ThreadCallback func, void* userdata)
+{
+    thread->func        = func;
+    thread->userdata    = userdata;
+    thread->handle      = CreateThread(NULL, 0, thread_proc, thread, 0, NULL);
+    
+    return (thread->handle) ? ERR_None : ERR_CouldNotCreate;
+}
+
+void thread_join(Thread* thread)
+{
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+}
+
+uint32_t thread_cpu_count(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (info.dwNumberOfProcessors > 0) ? (uint32_t)info.dwNumberOfProcessors : 1;
+}
+
+int mutex_init(Mutex* mutex)
+{
+    InitializeCriticalSection(&mutex->cs);
+    return ERR_None;
+}
+
+void mutex_deinit(Mutex* mutex)
+{
+    DeleteCriticalSection(&mutex->cs);
+}
+
+void mutex_lock(Mutex* mutex)
+{
+    EnterCriticalSection(&mutex->cs);
+}
+
+void mutex_unlock(Mutex* mutex)
+{
+    LeaveCriticalSection(&mutex->cs);
+}
+
+int semaphore_init(Semaphore* sem)
+{
+    sem->handle = CreateSemaphore(NULL, 0, LONG_MAX, NULL);
+    return (sem->handle) ? ERR_None : ERR_Semaphore;
+}
+
+void semaphore_deinit(Semaphore* sem)
+{
+    CloseHandle(sem->handle);
+}
+
+void semaphore_wait(Semaphore* sem)
+{
+    WaitForSingleObject(sem->handle, INFINITE);
+}
+
+void semaphore_post(Semaphore* sem)
+{
+    ReleaseSemaphore(sem->handle, 1, NULL);
+}
+#else
+static void* thread_proc(void* ptr)
+{
+    Thread* thread = (Thread*)ptr;
+    thread->func(thread->userdata);
+    return NULL;
+}
+
+int thread_start(Thread* thread, ThreadCallback func, void* userdata)
+{
+    thread->func        = func;
+    thread->userdata    = userdata;
+    
+    return pthread_create(&thread->handle, NULL, thread_proc, thread) ? ERR_CouldNotCreate : ERR_None;
+}
+
+void thread_join(Thread* thread)
+{
+    pthread_join(thread->handle, NULL);
+}
+
+uint32_t thread_cpu_count(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (uint32_t)n : 1;
+}
+
+int mutex_init(Mutex* mutex)
+{
+    return pthread_mutex_init(&mutex->mtx, NULL) ? ERR_Semaphore : ERR_None;
+}
+
+void mutex_deinit(Mutex* mutex)
+{
+    pthread_mutex_destroy(&mutex->mtx);
+}
+
+void mutex_lock(Mutex* mutex)
+{
+    pthread_mutex_lock(&mutex->mtx);
+}
+
+void mutex_unlock(Mutex* mutex)
+{
+    pthread_mutex_unlock(&mutex->mtx);
+}
+
+int semaphore_init(Semaphore* sem)
+{
+    return sem_init(&sem->sem, 0, 0) ? ERR_Semaphore : ERR_None;
+}
+
+void semaphore_deinit(Semaphore* sem)
+{
+    sem_destroy(&sem->sem);
+}
+
+void semaphore_wait(Semaphore* sem)
+{
+    int rc;
+    
+    do
+    {
+        rc = sem_wait(&sem->sem);
+    }
+    while (rc && errno == EINTR);
+}
+
+void semaphore_post(Semaphore* sem)
+{
+    sem_post(&sem->sem);
+}
+#endif
+
+static void thread_parallel_run(ParallelFor* job, uint32_t worker)
+{
+    for (;;)
+    {
+        uint32_t index = atomic_add_u32(&job->next, 1);
+        
+        if (index >= job->count)
+            break;
+        
+        job->func(job->userdata, index, worker);
+    }
+}
+
+static void thread_parallel_worker(void* ptr)
+{
+    ParallelWorker* worker = (ParallelWorker*)ptr;
+    thread_parallel_run(worker->job, worker->index);
+}
+
+int thread_parallel_for(uint32_t count, uint32_t maxWorkers, ParallelCallback func, void* userdata)
+{
+    Thread threads[PARALLEL_MAX_WORKERS];
+    ParallelWorker workers[PARALLEL_MAX_WORKERS];
+    ParallelFor job;
+    uint32_t started = 0;
+    uint32_t i;
+    
+    if (maxWorkers > PARALLEL_MAX_WORKERS)
+        maxWorkers = PARALLEL_MAX_WORKERS;
+    
+    if (maxWorkers > count)
+        maxWorkers = count;
+    
+    job.next        = 0;
+    job.count       = count;
+    job.func        = func;
+    job.userdata    = userdata;
+    
+    for (i = 0; i < maxWorkers; i++)
+    {
+        workers[i].job      = &job;
+        workers[i].index    = i;
+    }
+    
+    /* Worker 0 is the calling thread; if a thread can't be started the others just pick up its share */
+    for (i = 1; i < maxWorkers; i++)
+    {
+        if (thread_start(&threads[started], thread_parallel_worker, &workers[i]))
+            break;
+        
+        started++;
+    }
+    
+    if (count > 0)
+        thread_parallel_run(&job, 0);
+    
+    for (i = 0; i < started; i++)
+    {
+        thread_join(&threads[i]);
+    }
+    
+    return ERR_None;
+}
+
+/* Which thread gets which worker index is only settled as each one wakes up, so that a job asking
+   for fewer workers than the pool has still only sees indices below what it asked for */
+static void thread_pool_proc(void* ptr)
+{
+    ThreadPool* pool = (ThreadPool*)ptr;
+    
+    for (;;)
+    {
+        semaphore_wait(&pool->start);
+        
+        if (pool->stop)
+            break;
+        
+        thread_parallel_run(&pool->job, atomic_add_u32(&pool->nextWorker, 1));
+        semaphore_post(&pool->done);
+    }
+}
+
+ThreadPool* thread_pool_create(uint32_t threads)
+{
+    ThreadPool* pool = alloc_type(ThreadPool);
+    uint32_t i;
+    
+    if (!pool) return NULL;
+    
+    memset(pool, 0, sizeof(ThreadPool));
+    
+    if (semaphore_init(&pool->start))
+        goto fail_start;
+    
+    if (semaphore_init(&pool->done))
+        goto fail_done;
+    
+    if (threads > PARALLEL_MAX_WORKERS - 1)
+        threads = PARALLEL_MAX_WORKERS - 1;
+    
+    /* As with thread_parallel_for, any thread that can't be started just leaves the others more to do */
+    for (i = 0; i < threads; i++)
+    {
+        if (thread_start(&pool->threads[pool->count], thread_pool_proc, pool))
+            break;
+        
+        pool->count++;
+    }
+    
+    return pool;
+    
+fail_done:
+    semaphore_deinit(&pool->start);
+fail_start:
+    free(pool);
+    return NULL;
+}
+
+void thread_pool_destroy(ThreadPool* pool)
+{
+    uint32_t i;
+    
+    if (!pool) return;
+    
+    pool->stop = true;
+    
+    for (i = 0; i < pool->count; i++)
+    {
+        semaphore_post(&pool->start);
+    }
+    
+    for (i = 0; i < pool->count; i++)
+    {
+        thread_join(&pool->threads[i]);
+    }
+    
+    semaphore_deinit(&pool->start);
+    semaphore_deinit(&pool->done);
+    free(pool);
+}
+
+int thread_pool_for(ThreadPool* pool, uint32_t count, uint32_t maxWorkers, ParallelCallback func, void* userdata)
+{
+    uint32_t i;
+    
+    if (maxWorkers > pool->count + 1)
+        maxWorkers = pool->count + 1;
+    
+    if (maxWorkers > count)
+        maxWorkers = count;
+    
+    pool->job.next      = 0;
+    pool->job.count     = count;
+    pool->job.func      = func;
+    pool->job.userdata  = userdata;
+    pool->nextWorker    = 1;
+    
+    for (i = 1; i < maxWorkers; i++)
+    {
+        semaphore_post(&pool->start);
+    }
+    
+    if (count > 0)
+        thread_parallel_run(&pool->job, 0);
+    
+    /* The job lives in the pool, so the next one can't be set up until every thread is done with this one */
+    for (i = 1; i < maxWorkers; i++)
+    {
+        semaphore_wait(&pool->done);
+    }
+    
+    return ERR_None;
+}
+
+#undef PARALLEL_MAX_WORKERS
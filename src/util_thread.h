@@ -0,0 +1,74 @@
+
+#ifndef UTIL_THREAD_H
+#define UTIL_THREAD_H
+
+#include "define.h"
+
+#ifdef PLATFORM_UNIX
+# include <pthread.h>
+# include <semaphore.h>
+#endif
+
+typedef void(*ThreadCallback)(void* userdata);
+typedef void(*ParallelCallback)(void* userdata, uint32_t index, uint32_t worker);
+
+typedef struct Thread {
+#ifdef PLATFORM_WINDOWS
+    HANDLE          handle;
+#else
+    pthread_t       handle;
+#endif
+    ThreadCallback  func;
+    void*           userdata;
+} Thread;
+
+typedef struct Mutex {
+#ifdef PLATFORM_WINDOWS
+    CRITICAL_SECTION    cs;
+#else
+    pthread_mutex_t     mtx;
+#endif
+} Mutex;
+
+typedef struct Semaphore {
+#ifdef PLATFORM_WINDOWS
+    HANDLE  handle;
+#else
+    sem_t   sem;
+#endif
+} Semaphore;
+
+typedef struct ThreadPool ThreadPool;
+
+int thread_start(Thread* thread, ThreadCallback func, void* userdata);
+void thread_join(Thread* thread);
+uint32_t thread_cpu_count(void);
+
+/* Calls func once for every index in [0, count) using up to maxWorkers threads, including the
+   calling thread. Workers pull indices in order from a shared counter; worker is in [0, maxWorkers) */
+int thread_parallel_for(uint32_t count, uint32_t maxWorkers, ParallelCallback func, void* userdata);
+
+/* The same, but run on threads that are started once and then wait between jobs, rather than being
+   started and joined on every call. A pool of n threads runs up to n + 1 workers, the calling thread
+   being worker 0, and must only be given one job at a time. NULL if the pool couldn't be set up */
+ThreadPool* thread_pool_create(uint32_t threads);
+void thread_pool_destroy(ThreadPool* pool);
+int thread_pool_for(ThreadPool* pool, uint32_t count, uint32_t maxWorkers, ParallelCallback func, void* userdata);
+
+int mutex_init(Mutex* mutex);
+void mutex_deinit(Mutex* mutex);
+void mutex_lock(Mutex* mutex);
+void mutex_unlock(Mutex* mutex);
+
+int semaphore_init(Semaphore* sem);
+void semaphore_deinit(Semaphore* sem);
+void semaphore_wait(Semaphore* sem);
+void semaphore_post(Semaphore* sem);
+
+#ifdef PLATFORM_WINDOWS
+# define atomic_add_u32(ptr, n) ((uint32_t)InterlockedExchangeAdd((volatile LONG*)(ptr), (LONG)(n)))
+#else
+# define atomic_add_u32(ptr, n) __sync_fetch_and_add((ptr), (n))
+#endif
+
+#endif/*UTIL_THREAD_H*/
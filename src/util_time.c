@@ -0,0 +1,23 @@
+
+#include "util_time.h"
+
+#ifdef PLATFORM_UNIX
+# include <time.h>
+#endif
+
+#ifdef PLATFORM_WINDOWS
+double time_now(void)
+{
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / (double)freq.QuadPart;
+}
+#else
+double time_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+#endif
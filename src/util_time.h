@@ -0,0 +1,10 @@
+
+#ifndef UTIL_TIME_H
+#define UTIL_TIME_H
+
+#include "define.h"
+
+/* Seconds since some arbitrary fixed point; only good for measuring intervals */
+double time_now(void);
+
+#endif/*UTIL_TIME_H*/
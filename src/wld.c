@@ -7,33 +7,215 @@
 
 static void wld_init(Wld* wld, Buffer* file)
 {
-    array_init(&wld->fragsByIndex, Frag*);
-    tbl_init(&wld->fragsByNameRef, Frag*);
+    wld->fragCount = 0;
+    wld->fragOffsets = NULL;
+    wld->fragNameRefs = NULL;
+    wld->fragTypes = NULL;
+    wld->fragBase = file ? buf_writable(file) : NULL;
+    wld->typeStarts = NULL;
+    wld->typeFrags = NULL;
+    tbl_init(&wld->fragsByNameRef, uint32_t);
+    array_init(&wld->names, WldName);
+    wld->namesIndexed = false;
     
     wld->strings = NULL;
     wld->stringsLength = 0;
     wld->data = file;
+    wld->encoded = NULL;
+    wld->decodedBits = NULL;
 }
 
+static const byte wldStringKey[] = {0x95, 0x3A, 0xC5, 0x2A, 0x95, 0x7A, 0x95, 0x6A};
+
+/* The key is 8 bytes, so it lines up with 64-bit words and repeats exactly across SSE2 and AVX2 lanes */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# define WLD_XOR_SSE2
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+# include <immintrin.h>
+# define WLD_XOR_AVX2
+#endif
+
+#ifdef WLD_XOR_AVX2
+__attribute__((target("avx2")))
+static uint32_t wld_xor_avx2(byte* data, uint32_t len, uint64_t key)
+{
+    __m256i k = _mm256_set1_epi64x((long long)key);
+    uint32_t i;
+    
+    for (i = 0; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+        _mm256_storeu_si256((__m256i*)(data + i), _mm256_xor_si256(v, k));
+    }
+    
+    return i;
+}
+#endif
+
+#ifdef WLD_XOR_SSE2
+static uint32_t wld_xor_sse2(byte* data, uint32_t len, uint64_t key)
+{
+    __m128i k = _mm_loadl_epi64((const __m128i*)&key);
+    uint32_t i;
+    
+    k = _mm_unpacklo_epi64(k, k);
+    
+    for (i = 0; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        _mm_storeu_si128((__m128i*)(data + i), _mm_xor_si128(v, k));
+    }
+    
+    return i;
+}
+#endif
+
 void wld_process_string(void* str, uint32_t len)
 {
-    static const byte hash[] = {0x95, 0x3A, 0xC5, 0x2A, 0x95, 0x7A, 0x95, 0x6A};
     byte* data = (byte*)str;
+    uint64_t key;
+    uint32_t i = 0;
+    
+    /* Copying the key bytes in makes the word XOR the same as the byte one on either endianness */
+    memcpy(&key, wldStringKey, sizeof(key));
+    
+#ifdef WLD_XOR_AVX2
+    if (len >= 64 && __builtin_cpu_supports("avx2"))
+        i = wld_xor_avx2(data, len, key);
+#endif
+    
+#ifdef WLD_XOR_SSE2
+    if (len - i >= 16)
+        i += wld_xor_sse2(data + i, len - i, key);
+#endif
+    
+    /* Every path above stops on a multiple of 8, so the key is still in phase */
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof(w));
+        w ^= key;
+        memcpy(data + i, &w, sizeof(w));
+    }
+    
+    for (; i < len; i++)
+    {
+        data[i] ^= wldStringKey[i & 7];
+    }
+}
+
+int wld_check_header(const WldHeader* h)
+{
+    uint32_t ver = h->version & 0xfffffffe;
+    
+    if (h->signature != WLD_SIGNATURE || (ver != WLD_VERSION1 && ver != WLD_VERSION2))
+        return ERR_Invalid;
+    
+    return ERR_None;
+}
+
+/* Counting sort over the type bytes; the fragments themselves aren't touched */
+static int wld_build_type_index(Wld* wld)
+{
+    uint32_t n = wld->fragCount;
+    uint32_t* starts = alloc_array_type(256 + 1 + n, uint32_t);
+    uint32_t* frags;
     uint32_t i;
     
-    for (i = 0; i < len; i++)
+    if (!starts) return ERR_OutOfMemory;
+    
+    memset(starts, 0, (256 + 1) * sizeof(uint32_t)); /* Only the counts; every slot of frags gets written */
+    frags = starts + 256 + 1;
+    
+    for (i = 1; i <= n; i++)
+    {
+        starts[wld->fragTypes[i] + 1]++;
+    }
+    
+    for (i = 1; i <= 256; i++)
+    {
+        starts[i] += starts[i - 1];
+    }
+    
+    /* Each start is its list's cursor while filling, which leaves it at the start of the next list */
+    for (i = 1; i <= n; i++)
+    {
+        frags[starts[wld->fragTypes[i]]++] = i;
+    }
+    
+    for (i = 256; i > 0; i--)
     {
-        data[i] ^= hash[i & 7];
+        starts[i] = starts[i - 1];
     }
+    
+    starts[0] = 0;
+    
+    wld->typeStarts = starts;
+    wld->typeFrags = frags;
+    return ERR_None;
+}
+
+static int wld_name_cmp(const void* va, const void* vb)
+{
+    WldName* a = (WldName*)va;
+    WldName* b = (WldName*)vb;
+    int cmp = strcmp(a->name, b->name);
+    
+    return (cmp < 0) || (cmp == 0 && a->frag < b->frag);
+}
+
+/* With WLD_OPEN_LazyStrings, this decodes every fragment's name */
+static int wld_build_name_index(Wld* wld)
+{
+    uint32_t n = wld->fragCount;
+    WldName entry;
+    uint32_t i;
+    int rc;
+    
+    if (wld->namesIndexed)
+        return ERR_None;
+    
+    rc = array_reserve(&wld->names, n + 1); /* One over for array_sort's scratch element */
+    if (rc) return rc;
+    
+    for (i = 1; i <= n; i++)
+    {
+        entry.name = wld_name_by_ref(wld, wld->fragNameRefs[i]);
+        entry.frag = i;
+        
+        if (entry.name && !array_push_back(&wld->names, &entry))
+        {
+            rc = ERR_OutOfMemory;
+            goto abort;
+        }
+    }
+    
+    rc = array_sort(&wld->names, wld_name_cmp);
+    if (rc) goto abort;
+    
+    wld->namesIndexed = true;
+    return ERR_None;
+    
+abort:
+    /* A partial index would answer lookups wrongly; the next call starts over */
+    array_clear(&wld->names);
+    return rc;
 }
 
 int wld_open(Wld* wld, Buffer* file)
+{
+    return wld_open_flags(wld, file, WLD_OPEN_Default);
+}
+
+int wld_open_flags(Wld* wld, Buffer* file, int flags)
 {
     byte* data = buf_writable(file);
     uint32_t len = buf_length(file);
     WldHeader* h = (WldHeader*)data;
     uint32_t p = sizeof(WldHeader);
-    uint32_t ver;
     int stringsLength;
     int nameRef;
     Frag* frag;
@@ -45,35 +227,50 @@ int wld_open(Wld* wld, Buffer* file)
     if (p > len)
         goto oob;
     
-    if (h->signature != WLD_SIGNATURE)
-        return ERR_Invalid;
-    
-    ver = h->version & 0xfffffffe;
-    
-    if (ver != WLD_VERSION1 && ver != WLD_VERSION2)
+    if (wld_check_header(h))
         return ERR_Invalid;
     
     stringsLength = -((int)h->stringsLength);
-    wld->strings = (char*)&data[p];
     wld->stringsLength = stringsLength;
     
+    if (flags & WLD_OPEN_LazyStrings)
+        wld->encoded = &data[p];
+    else
+        wld->strings = (char*)&data[p];
+    
     p += h->stringsLength;
     
     if (p > len)
         goto oob;
     
-    wld_process_string(wld->strings, -stringsLength);
+    if (!wld->encoded)
+        wld_process_string(wld->strings, -stringsLength);
+    
+    n = h->fragCount;
+    
+    /* Every fragment takes at least a header, which keeps a bogus count from asking for too much */
+    if (n > (len - p) / sizeof(Frag))
+        goto oob;
+    
+    /* One block for the whole directory; the offsets come first, so it's what gets freed */
+    wld->fragOffsets = (uint32_t*)alloc_bytes((n + 1) * (sizeof(uint32_t) + sizeof(int) + sizeof(uint8_t)));
     
-    frag = NULL;
-    if (!array_push_back(&wld->fragsByIndex, (void*)&frag))
+    if (!wld->fragOffsets)
         return ERR_OutOfMemory;
     
-    n = h->fragCount;
+    wld->fragNameRefs = (int*)(wld->fragOffsets + n + 1);
+    wld->fragTypes = (uint8_t*)(wld->fragNameRefs + n + 1);
     
-    for (i = 0; i < n; i++)
+    wld->fragOffsets[0] = 0;
+    wld->fragNameRefs[0] = 0;
+    wld->fragTypes[0] = 0;
+    
+    for (i = 1; i <= n; i++)
     {
         frag = (Frag*)&data[p];
         
+        wld->fragOffsets[i] = p;
+        
         p += sizeof(Frag);
         
         if (p > len)
@@ -84,20 +281,30 @@ int wld_open(Wld* wld, Buffer* file)
         if (p > len)
             goto oob;
         
-        if (!array_push_back(&wld->fragsByIndex, (void*)&frag))
-            return ERR_OutOfMemory;
-        
         nameRef = frag->nameRef;
         
+        wld->fragNameRefs[i] = nameRef;
+        wld->fragTypes[i] = (frag->type < WLD_FRAG_TYPE_Large) ? (uint8_t)frag->type : WLD_FRAG_TYPE_Large;
+        wld->fragCount = i;
+        
         if (nameRef < 0 && nameRef > stringsLength)
         {
-            int rc = tbl_set_int(&wld->fragsByNameRef, nameRef, (void*)&frag);
+            int rc = tbl_set_int(&wld->fragsByNameRef, nameRef, &i);
             
             if (rc && rc != ERR_Again)
                 return rc;
         }
     }
     
+    if (flags & WLD_OPEN_TypeIndex)
+    {
+        int rc = wld_build_type_index(wld);
+        if (rc) return rc;
+    }
+    
+    if (flags & WLD_OPEN_NameIndex)
+        return wld_build_name_index(wld);
+    
     return ERR_None;
     
 oob:
@@ -106,9 +313,36 @@ oob:
 
 void wld_close(Wld* wld)
 {
-    array_deinit(&wld->fragsByIndex, NULL);
+    if (wld->fragOffsets)
+    {
+        free(wld->fragOffsets);
+        wld->fragOffsets = NULL;
+        wld->fragNameRefs = NULL;
+        wld->fragTypes = NULL;
+        wld->fragCount = 0;
+    }
+    
     tbl_deinit(&wld->fragsByNameRef, NULL);
     
+    array_deinit(&wld->names, NULL);
+    wld->namesIndexed = false;
+    
+    if (wld->typeStarts)
+    {
+        free(wld->typeStarts);
+        wld->typeStarts = NULL;
+        wld->typeFrags = NULL;
+    }
+    
+    if (wld->encoded)
+    {
+        if (wld->strings) free(wld->strings);
+        if (wld->decodedBits) free(wld->decodedBits);
+        wld->strings = NULL;
+        wld->decodedBits = NULL;
+        wld->encoded = NULL;
+    }
+    
     if (wld->data)
     {
         buf_destroy(wld->data);
@@ -121,27 +355,131 @@ const char* wld_frag_name(Wld* wld, Frag* frag)
     return wld_name_by_ref(wld, frag->nameRef);
 }
 
+/* Decodes from offset up to the end of the name there, skipping whatever an earlier name already covered */
+static int wld_decode_name(Wld* wld, uint32_t offset)
+{
+    uint32_t len = (uint32_t)(-wld->stringsLength);
+    
+    if (!wld->strings)
+    {
+        wld->strings = alloc_array_type(len + 1, char);
+        wld->decodedBits = alloc_bytes((len + 7) / 8);
+        
+        if (!wld->strings || !wld->decodedBits)
+        {
+            if (wld->strings) free(wld->strings);
+            if (wld->decodedBits) free(wld->decodedBits);
+            wld->strings = NULL;
+            wld->decodedBits = NULL;
+            return ERR_OutOfMemory;
+        }
+        
+        memset(wld->decodedBits, 0, (len + 7) / 8);
+        /* So a name that runs off the end of a malformed table still ends somewhere */
+        wld->strings[len] = 0;
+    }
+    
+    for (; offset < len; offset++)
+    {
+        byte* bits = &wld->decodedBits[offset >> 3];
+        byte bit = (byte)(1 << (offset & 7));
+        
+        if (!(*bits & bit))
+        {
+            wld->strings[offset] = (char)(wld->encoded[offset] ^ wldStringKey[offset & 7]);
+            *bits |= bit;
+        }
+        
+        if (wld->strings[offset] == 0)
+            break;
+    }
+    
+    return ERR_None;
+}
+
 const char* wld_name_by_ref(Wld* wld, int nameRef)
 {
     if (nameRef < 0 && nameRef > wld->stringsLength)
+    {
+        if (wld->encoded && wld_decode_name(wld, (uint32_t)(-nameRef)))
+            return NULL;
+        
         return wld->strings - nameRef;
+    }
     
     return NULL;
 }
 
 Frag* wld_frag_by_ref(Wld* wld, int ref)
 {
-    Frag** ptr = NULL;
+    uint32_t* index;
     
     if (ref > 0)
+        return ((uint32_t)ref <= wld->fragCount) ? wld_frag(wld, ref) : NULL;
+    
+    index = tbl_get_int(&wld->fragsByNameRef, ref, uint32_t);
+    
+    return (index) ? wld_frag(wld, *index) : NULL;
+}
+
+const uint32_t* wld_frags_of_type(Wld* wld, uint32_t type, uint32_t* count)
+{
+    *count = 0;
+    
+    if (!wld->typeStarts && wld_build_type_index(wld))
+        return NULL;
+    
+    if (type > WLD_FRAG_TYPE_Large)
+        type = WLD_FRAG_TYPE_Large;
+    
+    *count = wld->typeStarts[type + 1] - wld->typeStarts[type];
+    return wld->typeFrags + wld->typeStarts[type];
+}
+
+/* First entry at or after lo whose name's first len bytes don't compare below key's or, with above
+   set, compare above them */
+static uint32_t wld_name_bound(const WldName* names, uint32_t lo, uint32_t hi, const char* key, uint32_t len, bool above)
+{
+    while (lo < hi)
     {
-        if (ref < (int)array_count(&wld->fragsByIndex))
-            ptr = array_get(&wld->fragsByIndex, ref, Frag*);
-    }
-    else
-    {
-        ptr = tbl_get_int(&wld->fragsByNameRef, ref, Frag*);
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = strncmp(names[mid].name, key, len);
+        
+        if (cmp < 0 || (above && cmp == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
     }
     
-    return (ptr) ? *ptr : NULL;
+    return lo;
+}
+
+static const WldName* wld_name_range(Wld* wld, const char* key, uint32_t len, uint32_t* count)
+{
+    const WldName* names;
+    uint32_t n, lo, hi;
+    
+    *count = 0;
+    
+    if (wld_build_name_index(wld))
+        return NULL;
+    
+    names = array_data(&wld->names, WldName);
+    n = array_count(&wld->names);
+    lo = wld_name_bound(names, 0, n, key, len, false);
+    hi = wld_name_bound(names, lo, n, key, len, true);
+    
+    *count = hi - lo;
+    return names + lo;
+}
+
+const WldName* wld_frags_with_prefix(Wld* wld, const char* prefix, uint32_t* count)
+{
+    return wld_name_range(wld, prefix, strlen(prefix), count);
+}
+
+/* Comparing the terminator as well makes it a whole-name match */
+const WldName* wld_frags_named(Wld* wld, const char* name, uint32_t* count)
+{
+    return wld_name_range(wld, name, strlen(name) + 1, count);
 }
@@ -7,7 +7,18 @@
 #include "structs_wld_frag.h"
 #include "util_container.h"
 
+enum WldOpenFlag {
+    WLD_OPEN_Default        = 0,
+    WLD_OPEN_LazyStrings    = 1 << 0,   /* Decode each name the first time it's asked for, into a buffer of its own */
+    WLD_OPEN_TypeIndex      = 1 << 1,   /* Build the per-type index up front rather than on the first wld_frags_of_type */
+    WLD_OPEN_NameIndex      = 1 << 2    /* Likewise for the name index and wld_frags_with_prefix / wld_frags_named */
+};
+
+#define WLD_FRAG_TYPE_Large 0xff
+
+int wld_check_header(const WldHeader* h);
 int wld_open(Wld* wld, Buffer* file);
+int wld_open_flags(Wld* wld, Buffer* file, int flags);
 void wld_close(Wld* wld);
 void wld_process_string(void* str, uint32_t len);
 
@@ -15,4 +26,20 @@ const char* wld_frag_name(Wld* wld, Frag* frag);
 const char* wld_name_by_ref(Wld* wld, int nameRef);
 Frag* wld_frag_by_ref(Wld* wld, int ref);
 
+/* The fragment directory, indexed the same way as positive refs: 1 to wld_frag_count. The types and
+   name refs are kept in arrays of their own, so filtering on them doesn't touch the fragments at all */
+#define wld_frag_count(wld) ((wld)->fragCount)
+#define wld_frag(wld, i) ((Frag*)((wld)->fragBase + (wld)->fragOffsets[(i)]))
+#define wld_frag_type(wld, i) (((wld)->fragTypes[(i)] != WLD_FRAG_TYPE_Large) ? (uint32_t)(wld)->fragTypes[(i)] : wld_frag((wld), (i))->type)
+#define wld_frag_name_ref(wld, i) ((wld)->fragNameRefs[(i)])
+
+/* The indices of every fragment of a type, in file order. Types from WLD_FRAG_TYPE_Large up all share
+   one list, so check wld_frag_type on those. NULL if the index couldn't be built */
+const uint32_t* wld_frags_of_type(Wld* wld, uint32_t type, uint32_t* count);
+
+/* Every fragment whose name starts with prefix, or is exactly name, as a run of the name index:
+   sorted by name, then by fragment index. NULL if the index couldn't be built */
+const WldName* wld_frags_with_prefix(Wld* wld, const char* prefix, uint32_t* count);
+const WldName* wld_frags_named(Wld* wld, const char* name, uint32_t* count);
+
 #endif/*WLD_H*/
@@ -0,0 +1,284 @@
+
+#include "wld_rules.h"
+
+typedef struct WldRuleTail {
+    Frag*       frag;
+    const char* name;   /* Taken before the fragment was added, since that rewrites its nameRef */
+    uint32_t    index;
+    int         action;
+} WldRuleTail;
+
+void ruleset_init(WldRuleSet* rs)
+{
+    WldRuleNode root;
+    
+    array_init(&rs->nodes, WldRuleNode);
+    array_init(&rs->rules, WldRuleEntry);
+    rs->fingerprint = 0;
+    
+    root.child      = 0;
+    root.sibling    = 0;
+    root.rules      = WLD_RULE_NONE;
+    root.c          = 0;
+    
+    /* If this fails, ruleset_add says so */
+    array_push_back(&rs->nodes, &root);
+}
+
+void ruleset_deinit(WldRuleSet* rs)
+{
+    array_deinit(&rs->nodes, NULL);
+    array_deinit(&rs->rules, NULL);
+}
+
+static uint32_t ruleset_child(const WldRuleSet* rs, uint32_t node, char c)
+{
+    const WldRuleNode* nodes = array_data(&rs->nodes, WldRuleNode);
+    uint32_t i = nodes[node].child;
+    
+    while (i != 0)
+    {
+        if (nodes[i].c == c)
+            return i;
+        
+        i = nodes[i].sibling;
+    }
+    
+    return 0;
+}
+
+int ruleset_add(WldRuleSet* rs, const WldRule* rule)
+{
+    WldRuleEntry entry;
+    WldRuleEntry* prev;
+    uint64_t fp[3];
+    WldRuleNode* node;
+    const char* ptr;
+    uint32_t index = 0;
+    uint32_t i;
+    
+    if (array_empty(&rs->nodes))
+        return ERR_NotInitialized;
+    
+    for (ptr = rule->prefix; *ptr; ptr++)
+    {
+        uint32_t next = ruleset_child(rs, index, *ptr);
+        
+        if (next == 0)
+        {
+            WldRuleNode child;
+            
+            node = array_get(&rs->nodes, index, WldRuleNode);
+            
+            child.child     = 0;
+            child.sibling   = node->child;
+            child.rules     = WLD_RULE_NONE;
+            child.c         = *ptr;
+            
+            next = array_count(&rs->nodes);
+            
+            if (!array_push_back(&rs->nodes, &child))
+                return ERR_OutOfMemory;
+            
+            /* The push may have moved the nodes */
+            node = array_get(&rs->nodes, index, WldRuleNode);
+            node->child = next;
+        }
+        
+        index = next;
+    }
+    
+    entry.type      = rule->type;
+    entry.action    = rule->action;
+    entry.next      = WLD_RULE_NONE;
+    
+    if (!array_push_back(&rs->rules, &entry))
+        return ERR_OutOfMemory;
+    
+    fp[0] = rs->fingerprint;
+    fp[1] = hash_data64(rule->prefix, strlen(rule->prefix));
+    fp[2] = ((uint64_t)rule->type << 32) | (uint32_t)rule->action;
+    rs->fingerprint = hash_data64(fp, sizeof(fp));
+    
+    /* Keep each node's chain in the order the rules were added */
+    node = array_get(&rs->nodes, index, WldRuleNode);
+    i = array_count(&rs->rules) - 1;
+    
+    if (node->rules == WLD_RULE_NONE)
+    {
+        node->rules = i;
+        return ERR_None;
+    }
+    
+    prev = array_get(&rs->rules, node->rules, WldRuleEntry);
+    
+    while (prev->next != WLD_RULE_NONE)
+    {
+        prev = array_get(&rs->rules, prev->next, WldRuleEntry);
+    }
+    
+    prev->next = i;
+    return ERR_None;
+}
+
+int ruleset_add_list(WldRuleSet* rs, const WldRule* rules, uint32_t count)
+{
+    uint32_t i;
+    
+    for (i = 0; i < count; i++)
+    {
+        int rc = ruleset_add(rs, &rules[i]);
+        if (rc) return rc;
+    }
+    
+    return ERR_None;
+}
+
+int ruleset_match(const WldRuleSet* rs, const char* name, uint32_t type)
+{
+    const WldRuleNode* nodes = array_data(&rs->nodes, WldRuleNode);
+    const WldRuleEntry* rules = array_data(&rs->rules, WldRuleEntry);
+    uint32_t best = WLD_RULE_NONE;
+    uint32_t node = 0;
+    
+    if (!name || array_empty(&rs->rules))
+        return WLD_RULE_Keep;
+    
+    /* Every node on the way down is a prefix of the name; the earliest rule seen on any of them wins */
+    for (;;)
+    {
+        uint32_t i = nodes[node].rules;
+        
+        while (i != WLD_RULE_NONE && i < best)
+        {
+            if (rules[i].type == WLD_RULE_AnyType || rules[i].type == type)
+            {
+                best = i;
+                break;
+            }
+            
+            i = rules[i].next;
+        }
+        
+        if (*name == 0)
+            break;
+        
+        node = ruleset_child(rs, node, *name++);
+        
+        if (node == 0)
+            break;
+    }
+    
+    return (best != WLD_RULE_NONE) ? rules[best].action : WLD_RULE_Keep;
+}
+
+bool ruleset_may_match(const WldRuleSet* rs, const char* name)
+{
+    const WldRuleNode* nodes = array_data(&rs->nodes, WldRuleNode);
+    uint32_t node = 0;
+    
+    if (!name || array_empty(&rs->rules))
+        return false;
+    
+    for (;;)
+    {
+        if (nodes[node].rules != WLD_RULE_NONE)
+            return true;
+        
+        if (*name == 0)
+            return false;
+        
+        node = ruleset_child(rs, node, *name++);
+        
+        if (node == 0)
+            return false;
+    }
+}
+
+static int ruleset_emit_tail(VirtualWld* vwld, Wld* wld, WldRuleTail* tail)
+{
+    int rc;
+    
+    if (tail->action == WLD_RULE_MoveToEnd && tail->frag->type == 0x13)
+    {
+        Frag13* f13 = (Frag13*)tail->frag;
+        Frag* f12 = wld_frag_by_ref(wld, f13->ref);
+        
+        if (!f12 || f12->type != 0x12)
+            return ERR_Invalid;
+        
+        rc = vwld_add_new_frag(vwld, f12, wld_frag_name(wld, f12));
+        if (rc) return rc;
+        
+        f13->ref = vwld_last_added_ref(vwld);
+        return vwld_add_new_frag(vwld, f13, tail->name);
+    }
+    
+    /* A duplicate's refs were already fixed up when the original was added */
+    if (tail->action == WLD_RULE_Duplicate)
+        return vwld_add_new_frag(vwld, tail->frag, tail->name);
+    
+    return vwld_add_old_frag(vwld, tail->index, tail->frag, tail->name, tail->name ? strlen(tail->name) : 0);
+}
+
+int ruleset_apply(const WldRuleSet* rs, VirtualWld* vwld, Wld* wld, WldRuleStats* stats)
+{
+    uint32_t n = wld_frag_count(wld);
+    Array tail;
+    uint32_t i;
+    WldRuleTail entry;
+    WldRuleTail* t;
+    int rc = ERR_None;
+    
+    memset(stats, 0, sizeof(WldRuleStats));
+    array_init(&tail, WldRuleTail);
+    
+    for (i = 1; i <= n; i++)
+    {
+        Frag* frag = wld_frag(wld, i);
+        const char* name = wld_name_by_ref(wld, wld_frag_name_ref(wld, i));
+        int action = ruleset_match(rs, name, wld_frag_type(wld, i));
+        
+        if (action == WLD_RULE_Drop)
+        {
+            stats->dropped++;
+            continue;
+        }
+        
+        if (action == WLD_RULE_MoveToEnd || action == WLD_RULE_Duplicate)
+        {
+            entry.frag      = frag;
+            entry.name      = name;
+            entry.index     = i;
+            entry.action    = action;
+            
+            if (!array_push_back(&tail, &entry))
+            {
+                rc = ERR_OutOfMemory;
+                goto abort;
+            }
+            
+            if (action == WLD_RULE_MoveToEnd)
+            {
+                stats->moved++;
+                continue;
+            }
+            
+            stats->duplicated++;
+        }
+        
+        rc = vwld_add_old_frag(vwld, i, frag, name, name ? strlen(name) : 0);
+        if (rc) goto abort;
+    }
+    
+    i = 0;
+    while ( (t = array_get(&tail, i++, WldRuleTail)) )
+    {
+        rc = ruleset_emit_tail(vwld, wld, t);
+        if (rc) break;
+    }
+    
+abort:
+    array_deinit(&tail, NULL);
+    return rc;
+}
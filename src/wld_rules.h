@@ -0,0 +1,36 @@
+
+#ifndef WLD_RULES_H
+#define WLD_RULES_H
+
+#include "define.h"
+#include "structs.h"
+#include "util_container.h"
+#include "virtual_wld.h"
+#include "hash.h"
+
+#define WLD_RULE_AnyType    0xffffffff
+#define WLD_RULE_NONE       0xffffffff
+
+enum WldRuleAction {
+    WLD_RULE_Keep,
+    WLD_RULE_Drop,
+    WLD_RULE_MoveToEnd,     /* A moved 0x13 takes a new copy of the 0x12 it points at along with it */
+    WLD_RULE_Duplicate      /* Kept where it is, and a copy is added at the end */
+};
+
+/* A rule applies to the fragments of its type whose names start with its prefix. When several rules
+   apply to the same fragment, the one that was added first wins; fragments with no name are always kept.
+   Fragments that are moved or dropped mustn't be referenced by any that are kept */
+void ruleset_init(WldRuleSet* rs);
+void ruleset_deinit(WldRuleSet* rs);
+int ruleset_add(WldRuleSet* rs, const WldRule* rule);
+int ruleset_add_list(WldRuleSet* rs, const WldRule* rules, uint32_t count);
+#define ruleset_fingerprint(rs) ((rs)->fingerprint)
+
+int ruleset_match(const WldRuleSet* rs, const char* name, uint32_t type);
+/* True if some rule's prefix starts name, whatever its type; false means no fragment so named can match */
+bool ruleset_may_match(const WldRuleSet* rs, const char* name);
+/* Adds every fragment of wld to vwld in one pass, doing whatever the rules say with each */
+int ruleset_apply(const WldRuleSet* rs, VirtualWld* vwld, Wld* wld, WldRuleStats* stats);
+
+#endif/*WLD_RULES_H*/